@@ -0,0 +1,205 @@
+#include "checkpoint.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+#include "wal.h"
+
+namespace mvcc {
+
+namespace {
+
+constexpr char kMagic[] = {'M', 'V', 'C', 'C', 'C', 'K', 'P', 'T'};
+
+struct CheckpointHeader {
+  char magic[sizeof(kMagic)];
+  uint64_t wal_lsn;
+  uint64_t entry_num;
+  uint32_t checksum;
+  uint32_t reserved;
+};
+
+// Flush buffered entries once they exceed the threshold.
+constexpr size_t kWriteBufferSize = 1 << 20;
+
+// Number of entries loaded in one transaction on recovery.
+constexpr size_t kLoadBatchSize = 1024;
+
+bool WriteAll(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    const ssize_t written = write(fd, data, len);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written < 0) {
+      return false;
+    }
+    data += written;
+    len -= written;
+  }
+  return true;
+}
+
+// Sync the directory containing [path], so a rename within it is durable.
+bool SyncParentDirectory(const std::string& path) {
+  const auto pos = path.rfind('/');
+  const std::string dir = pos == std::string::npos ? "." : path.substr(0, pos);
+  const int fd = open(dir.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  const bool ok = fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+template <typename T>
+void AppendInt(std::string* buffer, T value) {
+  buffer->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// Load entries in the mapped checkpoint [data] of [len] bytes into [db], and
+// get the log position it corresponds to; return false if it's corrupted.
+bool LoadCheckpoint(const char* data, size_t len, Database* db,
+                    uint64_t* wal_lsn) {
+  CheckpointHeader header;
+  if (len < sizeof(header)) {
+    return false;
+  }
+  std::memcpy(&header, data, sizeof(header));
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) {
+    return false;
+  }
+  const char* entry = data + sizeof(header);
+  const char* const end = data + len;
+  if (Crc32(entry, end - entry) != header.checksum) {
+    return false;
+  }
+
+  // Entries are validated by checksum, only need to guard lengths.
+  uint64_t loaded_num = 0;
+  while (loaded_num < header.entry_num) {
+    auto conn = db->CreateConn();
+    for (size_t idx = 0;
+         idx < kLoadBatchSize && loaded_num < header.entry_num;
+         ++idx, ++loaded_num) {
+      uint32_t key_len = 0;
+      uint32_t value_len = 0;
+      if (static_cast<size_t>(end - entry) < sizeof(key_len) * 2) {
+        return false;
+      }
+      std::memcpy(&key_len, entry, sizeof(key_len));
+      std::memcpy(&value_len, entry + sizeof(key_len), sizeof(value_len));
+      entry += sizeof(key_len) * 2;
+      if (static_cast<uint64_t>(end - entry)
+          < static_cast<uint64_t>(key_len) + value_len) {
+        return false;
+      }
+      conn.Set(KeyType(entry, key_len), ValueType(entry + key_len, value_len));
+      entry += key_len + value_len;
+    }
+    if (!conn.Commit()) {
+      return false;
+    }
+  }
+  *wal_lsn = header.wal_lsn;
+  return entry == end;
+}
+
+}  // namespace
+
+bool WriteCheckpoint(Database* db, const std::string& path) {
+  const std::string tmp_path = path + ".tmp";
+  const int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+
+  CheckpointHeader header{};
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  bool ok = lseek(fd, sizeof(header), SEEK_SET) >= 0;
+
+  // Snapshot is taken at the log position, so the checkpoint contains exactly
+  // transactions logged before [wal_lsn].
+  auto conn = db->CreateCheckpointConn(&header.wal_lsn);
+  std::string buffer;
+  conn.ForEach([&](const KeyType& key, const ValueType& value) {
+    AppendInt<uint32_t>(&buffer, key.size());
+    AppendInt<uint32_t>(&buffer, value.size());
+    buffer.append(key);
+    buffer.append(value);
+    ++header.entry_num;
+    if (buffer.size() >= kWriteBufferSize) {
+      header.checksum = Crc32(buffer.data(), buffer.size(), header.checksum);
+      ok = ok && WriteAll(fd, buffer.data(), buffer.size());
+      buffer.clear();
+    }
+  });
+  conn.Commit();
+  header.checksum = Crc32(buffer.data(), buffer.size(), header.checksum);
+  ok = ok && WriteAll(fd, buffer.data(), buffer.size());
+
+  // Header goes last, so a checkpoint without complete entries never passes
+  // checksum.
+  ok = ok && pwrite(fd, &header, sizeof(header), 0)
+      == static_cast<ssize_t>(sizeof(header));
+  ok = ok && fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  ok = ok && rename(tmp_path.c_str(), path.c_str()) == 0;
+  ok = ok && SyncParentDirectory(path);
+  if (!ok) {
+    unlink(tmp_path.c_str());
+  }
+  return ok;
+}
+
+bool Recover(const std::string& checkpoint_path, const std::string& wal_path,
+             Database* db) {
+  uint64_t wal_lsn = 0;
+  const int fd = open(checkpoint_path.c_str(), O_RDONLY);
+  if (fd < 0 && errno != ENOENT) {
+    return false;
+  }
+  if (fd >= 0) {
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+      close(fd);
+      return false;
+    }
+    const size_t len = file_stat.st_size;
+    void* data = len == 0
+        ? MAP_FAILED : mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    madvise(data, len, MADV_SEQUENTIAL);
+    const bool ok =
+        LoadCheckpoint(static_cast<const char*>(data), len, db, &wal_lsn);
+    munmap(data, len);
+    if (!ok) {
+      return false;
+    }
+  }
+
+  // Log might not exist yet, if nothing has been committed.
+  if (access(wal_path.c_str(), F_OK) == 0
+      && !ReplayWal(wal_path, db, wal_lsn)) {
+    return false;
+  }
+  auto wal = WriteAheadLog::Open(wal_path, wal_lsn);
+  if (wal == nullptr) {
+    return false;
+  }
+  db->SetDurabilityPolicy(std::move(wal));
+  return true;
+}
+
+}  // namespace mvcc
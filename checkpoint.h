@@ -0,0 +1,37 @@
+// Checkpoint for [Database], which bounds recovery time by write-ahead log
+// records since the last checkpoint, instead of the whole history.
+//
+// Checkpoint file is a binary image for all visible key-value pairs in one
+// snapshot, and the log position the snapshot corresponds to:
+//   file   := header | entry*
+//   header := magic (8 bytes) | wal_lsn (u64) | entry_num (u64) |
+//             crc32(entry*) (u32) | reserved (u32)
+//   entry  := key_len (u32) | value_len (u32) | key | value
+// Integers are stored in host byte order.
+//
+// Checkpoint is taken by a read-only transaction, so writers are not blocked
+// except for the instant the snapshot is taken. It's written into a temporary
+// file first, and atomically renamed after sync, so a crash never leaves a
+// partial checkpoint behind.
+
+#pragma once
+
+#include <string>
+
+#include "mvcc.h"
+
+namespace mvcc {
+
+// Write a checkpoint for [db] at [path], replacing the existing one; return
+// false on IO failure, in which case the existing checkpoint is kept.
+bool WriteCheckpoint(Database* db, const std::string& path);
+
+// Recover [db] from checkpoint at [checkpoint_path] and records after it in
+// log file at [wal_path], then set the log as durability policy for [db].
+// A missing checkpoint means recovering from the whole log. It should be
+// invoked before any connection is created; return false if either file is
+// corrupted or cannot be opened.
+bool Recover(const std::string& checkpoint_path, const std::string& wal_path,
+             Database* db);
+
+}  // namespace mvcc
@@ -0,0 +1,98 @@
+#include "checkpoint.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+
+#include "test_utils.h"
+#include "wal.h"
+
+namespace mvcc {
+
+// Testing senario: recovery loads the checkpoint, and only replays records
+// logged after it, including the ones racing with checkpoint.
+void TestCheckpointAndReplayTail() {
+  const auto checkpoint_path = GetTestTmpPath("checkpoint_test_tail.ckpt");
+  const auto wal_path = GetTestTmpPath("checkpoint_test_tail.log");
+  unlink(checkpoint_path.c_str());
+  unlink(wal_path.c_str());
+
+  constexpr int kKeyNum = 3000;
+  {
+    Database db{};
+    EXPECT_TRUE(Recover(checkpoint_path, wal_path, &db));
+    for (int idx = 0; idx < kKeyNum; ++idx) {
+      auto conn = db.CreateConn();
+      conn.Set("key-" + std::to_string(idx), "val");
+      EXPECT_TRUE(conn.Commit());
+    }
+
+    // Writers keep committing while checkpoint is being written.
+    std::thread writer([&db]() {
+      for (int idx = 0; idx < kKeyNum; ++idx) {
+        auto conn = db.CreateConn();
+        conn.Set("racing-key-" + std::to_string(idx), "val");
+        EXPECT_TRUE(conn.Commit());
+      }
+    });
+    EXPECT_TRUE(WriteCheckpoint(&db, checkpoint_path));
+    writer.join();
+
+    auto conn = db.CreateConn();
+    conn.Set("key-0", "new-val");
+    EXPECT_TRUE(conn.Delete("key-1"));
+    EXPECT_TRUE(conn.Commit());
+  }
+
+  // Recover twice, to make sure log keeps appending at the right position.
+  for (int round = 0; round < 2; ++round) {
+    Database db{};
+    EXPECT_TRUE(Recover(checkpoint_path, wal_path, &db));
+    AssertHasKeyValue(&db, "key-0", round == 0 ? "new-val" : "newer-val");
+    AssertHasKeyValue(&db, "key-2", "val");
+    AssertHasKeyValue(&db, "racing-key-" + std::to_string(kKeyNum - 1), "val");
+    auto conn = db.CreateConn();
+    EXPECT_FALSE(conn.Get("key-1").has_value());
+    conn.Set("key-0", "newer-val");
+    EXPECT_TRUE(conn.Commit());
+  }
+}
+
+// Testing senario: a corrupted checkpoint is rejected instead of partially
+// loaded.
+void TestCorruptedCheckpoint() {
+  const auto checkpoint_path = GetTestTmpPath("checkpoint_test_corrupt.ckpt");
+  const auto wal_path = GetTestTmpPath("checkpoint_test_corrupt.log");
+  unlink(checkpoint_path.c_str());
+  unlink(wal_path.c_str());
+
+  {
+    Database db{};
+    EXPECT_TRUE(Recover(checkpoint_path, wal_path, &db));
+    auto conn = db.CreateConn();
+    conn.Set("key", "val");
+    EXPECT_TRUE(conn.Commit());
+    EXPECT_TRUE(WriteCheckpoint(&db, checkpoint_path));
+  }
+  {
+    const int fd = open(checkpoint_path.c_str(), O_WRONLY);
+    EXPECT_TRUE(fd >= 0);
+    const char garbage = 'x';
+    EXPECT_EQ(lseek(fd, -1, SEEK_END) >= 0, true);
+    EXPECT_EQ(write(fd, &garbage, 1), 1);
+    close(fd);
+  }
+
+  Database db{};
+  EXPECT_FALSE(Recover(checkpoint_path, wal_path, &db));
+}
+
+}  // namespace mvcc
+
+int main(int argc, char** argv) {
+  mvcc::TestCheckpointAndReplayTail();
+  mvcc::TestCorruptedCheckpoint();
+  return 0;
+}
@@ -1,25 +1,251 @@
 #include "mvcc.h"
 
+#include <algorithm>
+#include <cassert>
+#include <chrono>
 #include <iostream>
+#include <iterator>
+#include <thread>
 #include <utility>
 
+// Trace points only invoke the hook if tracing is enabled at build time, eg:
+//   bazel build --copt=-DMVCC_ENABLE_TRACING //:mvcc
+#ifdef MVCC_ENABLE_TRACING
+#define MVCC_TRACE(db, event, txn_id)      \
+  do {                                     \
+    if ((db)->trace_hook != nullptr) {     \
+      (db)->trace_hook((event), (txn_id)); \
+    }                                      \
+  } while (0)
+#else
+#define MVCC_TRACE(db, event, txn_id) \
+  do {                                \
+  } while (0)
+#endif
+
 namespace mvcc {
 
-Connection Database::CreateConn() {
+namespace {
+
+// Invoke [fn] with [IsolationPolicy] for [level], so it runs a path
+// specialized at compile time.
+template <typename Fn>
+decltype(auto) WithIsolationPolicy(IsolationLevel level, Fn&& fn) {
+  switch (level) {
+    case IsolationLevel::kReadCommittedIsolation:
+      return fn(
+          IsolationPolicy<IsolationLevel::kReadCommittedIsolation>{});
+    case IsolationLevel::kSnapshotIsolation:
+      return fn(IsolationPolicy<IsolationLevel::kSnapshotIsolation>{});
+    case IsolationLevel::kSerializableIsolation:
+      return fn(IsolationPolicy<IsolationLevel::kSerializableIsolation>{});
+    default:
+      return fn(
+          IsolationPolicy<IsolationLevel::kRepeatableReadIsolation>{});
+  }
+}
+
+// Release the version owned by [link], which then owns older versions.
+// Older versions are detached first: move-assigning `(*link)->older` to
+// [link] directly releases the version before reading its deleter, while
+// other threads could have reused it from version pool.
+void UnlinkVersion(VersionPtr* link) {
+  VersionPtr older = std::move((*link)->older);
+  *link = std::move(older);
+}
+
+// Release all versions starting from [version] iteratively.
+void ReleaseVersions(VersionPtr version) {
+  while (version != nullptr) {
+    UnlinkVersion(&version);
+  }
+}
+
+// Add half-open range [begin, end) into disjoint [ranges], merging
+// overlapping and adjacent ones.
+void AddRange(std::map<KeyType, KeyType>* ranges, KeyType begin,
+              KeyType end) {
+  auto iter = ranges->upper_bound(begin);
+  if (iter != ranges->begin() && std::prev(iter)->second >= begin) {
+    --iter;
+    begin = iter->first;
+  }
+  while (iter != ranges->end() && iter->first <= end) {
+    end = std::max(end, iter->second);
+    iter = ranges->erase(iter);
+  }
+  ranges->emplace_hint(iter, std::move(begin), std::move(end));
+}
+
+// Returns whether [key] is covered by disjoint [ranges].
+bool RangesContain(const std::map<KeyType, KeyType>& ranges,
+                   const KeyType& key) {
+  auto iter = ranges.upper_bound(key);
+  return iter != ranges.begin() && key < std::prev(iter)->second;
+}
+
+// Sort [order] of (shard index, key index) pairs by shard, then by key which
+// is got by [get_key]; pairs with the same key keep their original order.
+template <typename GetKey>
+void SortByShardAndKey(std::vector<std::pair<size_t, size_t>>* order,
+                       GetKey get_key) {
+  std::stable_sort(order->begin(), order->end(),
+                   [&get_key](const auto& lhs, const auto& rhs) {
+                     if (lhs.first != rhs.first) {
+                       return lhs.first < rhs.first;
+                     }
+                     return get_key(lhs.second) < get_key(rhs.second);
+                   });
+}
+
+}  // namespace
+
+RangeFingerprint::KeyHashes RangeFingerprint::HashKey(std::string_view key) {
+  // FNV-1a over prefix bytes, finalized per prefix so nearby prefixes spread
+  // over blocks.
+  KeyHashes key_hashes;
+  key_hashes.prefix_num = std::min(key.size(), kMaxPrefixLen) + 1;
+  uint64_t hash = 0xCBF29CE484222325ull;
+  for (size_t len = 0; len < key_hashes.prefix_num; ++len) {
+    if (len > 0) {
+      hash = (hash ^ static_cast<uint8_t>(key[len - 1])) * 0x100000001B3ull;
+    }
+    key_hashes.prefix_hashes[len] =
+        (hash ^ (hash >> 29)) * 0x9E3779B97F4A7C15ull;
+  }
+  return key_hashes;
+}
+
+void RangeFingerprint::Add(std::string_view begin, std::string_view end) {
+  size_t len = 0;
+  while (len < kMaxPrefixLen && len < begin.size() && len < end.size()
+         && begin[len] == end[len]) {
+    ++len;
+  }
+  const uint64_t hash = HashKey(begin.substr(0, len)).prefix_hashes[len];
+  bits_[GetBlock(hash)] |= GetMask(hash);
+  prefix_lens_ |= 1u << len;
+}
+
+PackedValue& PackedValue::operator=(ValueType value) {
+  if (value.size() > kInlineCapacity) {
+    if (IsInline()) {
+      auto* heap_value = new ValueType();
+      std::memcpy(bytes_, &heap_value, sizeof(heap_value));
+      bytes_[kTagPos] = static_cast<char>(kHeapTag);
+    }
+    *GetHeapValue() = std::move(value);
+    return *this;
+  }
+  if (!IsInline()) {
+    delete GetHeapValue();
+  }
+  std::memcpy(bytes_, value.data(), value.size());
+  bytes_[kTagPos] = static_cast<char>(value.size());
+  return *this;
+}
+
+void PackedValue::Clear() {
+  if (IsInline()) {
+    bytes_[kTagPos] = 0;
+    return;
+  }
+  // Keep the heap string for the next large value.
+  ValueType().swap(*GetHeapValue());
+}
+
+void VersionDeleter::operator()(ValueWrapper* version) const {
+  // Release older versions iteratively, to avoid deep recursion.
+  ReleaseVersions(std::move(version->older));
+  pool->Release(version);
+}
+
+VersionPtr VersionPool::Allocate() {
+  std::lock_guard lck(mutex_);
+  if (free_versions_.empty()) {
+    slabs_.emplace_back(std::make_unique<ValueWrapper[]>(kSlabSize));
+    ValueWrapper* slab = slabs_.back().get();
+    for (size_t idx = kSlabSize; idx > 0; --idx) {
+      free_versions_.emplace_back(slab + idx - 1);
+    }
+  }
+  ValueWrapper* version = free_versions_.back();
+  free_versions_.pop_back();
+  return VersionPtr(version, VersionDeleter{this});
+}
+
+size_t VersionPool::GetAllocatedNum() {
+  std::lock_guard lck(mutex_);
+  return slabs_.size() * kSlabSize - free_versions_.size();
+}
+
+void VersionPool::Release(ValueWrapper* version) {
+  version->value.Clear();
+  version->start_txn_id = kInvalidTxnId;
+  version->is_deleted = false;
+  version->hint_bits = 0;
+  std::lock_guard lck(mutex_);
+  free_versions_.emplace_back(version);
+}
+
+VersionChain::~VersionChain() {
+  ReleaseVersions(std::move(head));
+}
+
+CommitLog::~CommitLog() {
+  for (auto& segment : segments_) {
+    delete[] segment.load();
+  }
+}
+
+void CommitLog::SetState(TxnId txn_id, TransactionState state) {
+  auto& segment = segments_.at(txn_id / kSegmentSize);
+  Segment* states = segment.load(std::memory_order_acquire);
+  if (states == nullptr) {
+    std::lock_guard lck(alloc_mutex_);
+    states = segment.load(std::memory_order_relaxed);
+    if (states == nullptr) {
+      // Value-initialized to [TransactionState::kInvalid].
+      states = new Segment[kSegmentSize]();
+      segment.store(states, std::memory_order_release);
+    }
+  }
+  states[txn_id % kSegmentSize].store(state, std::memory_order_release);
+}
+
+TransactionState CommitLog::GetState(TxnId txn_id) const {
+  const Segment* states =
+      segments_[txn_id / kSegmentSize].load(std::memory_order_acquire);
+  return states[txn_id % kSegmentSize].load(std::memory_order_acquire);
+}
+
+Connection Database::CreateConn(IsolationLevel isolation_level) {
   auto txn = std::make_shared<Transaction>();
-  txn->txn_id = next_txn_id++;
-  txn->isolation_level = isolation_level_;
-  txn->state = TransactionState::kInProgress;
+  txn->isolation_level = isolation_level;
 
-  // Get all in-process transactions.
-  for (const auto& [cur_txn_id, cur_txn] : db_txns) {
-    if (cur_txn->state == TransactionState::kInProgress) {
-      txn->inprogress_txns.insert(cur_txn_id);
+  {
+    // Allocate txn id and take snapshot under the same critical section, so a
+    // transaction never misses a concurrent one started before it.
+    std::unique_lock lck(active_txns_mutex);
+    txn->txn_id = AllocateTxnId(&lck);
+    // Txn ids are exhausted, fail writes at once and skip serializable
+    // tracking.
+    if (txn->txn_id > kMaxTxnId) {
+      txn->write_conflict = true;
+      txn->isolation_level = IsolationLevel::kSnapshotIsolation;
     }
+    SetTxnState(txn.get(), TransactionState::kInProgress);
+    txn->snapshot = TakeSnapshot(txn->txn_id);
+    active_txns.emplace(txn->txn_id, txn->snapshot.xmin);
   }
+  ThreadStats::Add(&GetThreadStats()->begin_num);
+  MVCC_TRACE(this, TraceEvent::kBegin, txn->txn_id);
 
-  // Add current transaction into database.
-  db_txns.emplace(txn->txn_id, txn);
+  // Register serializable transaction before any of its reads and writes.
+  if (txn->isolation_level == IsolationLevel::kSerializableIsolation) {
+    std::lock_guard lck(ssi_mutex);
+    ssi_txns.emplace(txn->txn_id, txn);
+  }
 
   Connection conn;
   conn.db = this;
@@ -28,41 +254,755 @@ Connection Database::CreateConn() {
   return conn;
 }
 
-bool Database::HasWriteConflict(Transaction* txn1, Transaction* txn2) {
-  const auto& write_set1 = txn1->write_set;
-  const auto& write_set2 = txn2->write_set;
+Connection Database::CreateReadOnlyConn(IsolationLevel isolation_level) {
+  if (isolation_level != IsolationLevel::kSerializableIsolation) {
+    auto txn = std::make_shared<Transaction>();
+    txn->isolation_level = isolation_level;
+    txn->read_only = true;
+    txn->state = TransactionState::kInProgress;
+    bool registered = false;
+    {
+      std::shared_lock lck(active_txns_mutex);
+      txn->snapshot = TakeSnapshot(next_txn_id);
+      registered = RegisterReader(txn.get());
+    }
+    if (registered) {
+      auto* stats = GetThreadStats();
+      ThreadStats::Add(&stats->begin_num);
+      ThreadStats::Add(&stats->read_only_begin_num);
+      MVCC_TRACE(this, TraceEvent::kBegin, kInvalidTxnId);
+      Connection conn;
+      conn.db = this;
+      conn.txn = std::move(txn);
+      return conn;
+    }
+  }
 
-  for (const auto& cur_key : write_set1) {
-    if (write_set2.find(cur_key) != write_set2.end()) {
-      return true;
+  // Fall back to a regular transaction, if it's serializable or the reader
+  // registry is full.
+  auto conn = CreateConn(isolation_level);
+  conn.txn->read_only = true;
+  ThreadStats::Add(&GetThreadStats()->read_only_begin_num);
+  return conn;
+}
+
+TxnId Database::AllocateTxnId(std::unique_lock<std::shared_mutex>* lck) {
+  // Fetch the next range once the current one runs out; ids in between
+  // belong to other databases sharing the oracle, and never show up here.
+  while (timestamp_oracle != nullptr && next_txn_id >= txn_id_range_end) {
+    const TxnId range_end = txn_id_range_end;
+    // Oracle could be remote, so don't block transactions finishing or
+    // taking snapshots meanwhile.
+    lck->unlock();
+    {
+      std::lock_guard oracle_lck(oracle_mutex);
+      // Only the first thread fetches for the exhausted range, others retry
+      // with what it fetched.
+      if (txn_id_range_end == range_end) {
+        const TxnId range_begin =
+            timestamp_oracle->AllocateRange(txn_id_batch_size);
+        lck->lock();
+        assert(range_begin >= next_txn_id);
+        next_txn_id = range_begin;
+        txn_id_range_end = range_begin + txn_id_batch_size;
+        lck->unlock();
+      }
     }
+    lck->lock();
   }
+  return next_txn_id++;
+}
 
-  return false;
+std::optional<Connection> Database::CreateConnAsOf(TxnId as_of) {
+  auto txn = std::make_shared<Transaction>();
+  txn->isolation_level = IsolationLevel::kSnapshotIsolation;
+  txn->read_only = true;
+  txn->state = TransactionState::kInProgress;
+  // Hold GC off, so history watermark cannot pass the snapshot before its
+  // xmin is published.
+  std::lock_guard gc_lck(gc_mutex);
+  bool registered = false;
+  {
+    std::unique_lock lck(active_txns_mutex);
+    if (as_of == kInvalidTxnId || as_of > next_txn_id) {
+      return std::nullopt;
+    }
+    // Hand out the next txn id, so transactions finishing from now on are
+    // after [as_of], and invisible to the snapshot like to later ones.
+    if (as_of == next_txn_id) {
+      AllocateTxnId(&lck);
+    }
+    txn->snapshot = TakeSnapshotAsOf(as_of);
+    // Versions shadowed for the snapshot might have been pruned.
+    if (txn->snapshot.xmin < gc_history_watermark) {
+      return std::nullopt;
+    }
+    registered = RegisterReader(txn.get());
+  }
+
+  if (!registered) {
+    // Fall back to a regular transaction if the reader registry is full,
+    // which publishes the historical snapshot xmin instead.
+    auto conn = CreateConn(IsolationLevel::kSnapshotIsolation);
+    conn.txn->read_only = true;
+    std::unique_lock lck(active_txns_mutex);
+    conn.txn->snapshot = std::move(txn->snapshot);
+    active_txns[conn.txn->txn_id] = conn.txn->snapshot.xmin;
+    return conn;
+  }
+  auto* stats = GetThreadStats();
+  ThreadStats::Add(&stats->begin_num);
+  ThreadStats::Add(&stats->read_only_begin_num);
+  MVCC_TRACE(this, TraceEvent::kBegin, kInvalidTxnId);
+  Connection conn;
+  conn.db = this;
+  conn.txn = std::move(txn);
+  return conn;
 }
 
-bool Database::HasReadWriteConflict(Transaction* txn1, Transaction* txn2) {
-  // Check read set for [txn1] and write set for [txn2].
-  const auto& write_set1 = txn1->write_set;
-  const auto& read_set2 = txn2->read_set;
+Snapshot Database::TakeSnapshot(TxnId xmax) const {
+  // Get all in-process transactions, which are already sorted.
+  Snapshot snapshot;
+  snapshot.xmax = xmax;
+  snapshot.active_txns.reserve(active_txns.size());
+  for (const auto& [cur_txn_id, _] : active_txns) {
+    if (cur_txn_id >= xmax) {
+      break;
+    }
+    snapshot.active_txns.emplace_back(cur_txn_id);
+  }
+  snapshot.xmin = snapshot.active_txns.empty()
+      ? snapshot.xmax : snapshot.active_txns.front();
+  return snapshot;
+}
 
-  for (const auto& cur_key : write_set1) {
-    if (read_set2.find(cur_key) != read_set2.end()) {
+Snapshot Database::TakeSnapshotAsOf(TxnId as_of) const {
+  Snapshot snapshot = TakeSnapshot(as_of);
+  // Writers committed after [as_of] was handed out were still in progress.
+  auto iter = std::upper_bound(
+      late_committers.begin(), late_committers.end(), as_of,
+      [](TxnId txn_id, const auto& committer) {
+        return txn_id < committer.first;
+      });
+  for (; iter != late_committers.end(); ++iter) {
+    if (iter->second < as_of) {
+      snapshot.active_txns.emplace_back(iter->second);
+    }
+  }
+  std::sort(snapshot.active_txns.begin(), snapshot.active_txns.end());
+  snapshot.xmin = snapshot.active_txns.empty()
+      ? snapshot.xmax : snapshot.active_txns.front();
+  return snapshot;
+}
+
+bool Database::RegisterReader(Transaction* txn) {
+  // Start from a per-thread slot, so concurrent readers rarely collide.
+  const size_t start =
+      std::hash<std::thread::id>{}(std::this_thread::get_id());
+  for (size_t idx = 0; idx < kReaderSlotNum; ++idx) {
+    const size_t slot = (start + idx) % kReaderSlotNum;
+    TxnId expected = kInvalidTxnId;
+    if (reader_slots[slot].compare_exchange_strong(expected,
+                                                   txn->snapshot.xmin)) {
+      txn->reader_slot = slot;
       return true;
     }
   }
+  return false;
+}
 
-  // Check read set for [txn2] and write set for [txn1].
-  const auto& read_set1 = txn1->read_set;
-  const auto& write_set2 = txn2->write_set;
+size_t Database::GetShardIndex(std::string_view key) {
+  return std::hash<std::string_view>{}(key) % kStorageShardNum;
+}
 
-  for (const auto& cur_key : read_set1) {
-    if (write_set2.find(cur_key) != write_set2.end()) {
-      return true;
+Connection Database::CreateCheckpointConn(uint64_t* lsn) {
+  // Checkpoint needs a consistent snapshot whatever the default level is.
+  constexpr auto kIsolationLevel = IsolationLevel::kSnapshotIsolation;
+  std::unique_lock lck(checkpoint_mutex);
+  if (durability_policy == nullptr) {
+    *lsn = 0;
+    return CreateReadOnlyConn(kIsolationLevel);
+  }
+  *lsn = durability_policy->GetAppendedLsn();
+  auto conn = CreateReadOnlyConn(kIsolationLevel);
+  lck.unlock();
+
+  // Checkpoint shouldn't contain transactions which could be lost on crash.
+  durability_policy->WaitDurable(*lsn);
+  return conn;
+}
+
+Database::StorageShard& Database::GetShard(std::string_view key) {
+  return storage[GetShardIndex(key)];
+}
+
+void Database::SetTxnState(Transaction* txn, TransactionState state) {
+  txn->state = state;
+  // Transactions beyond [kMaxTxnId] never write, so nobody looks them up.
+  if (txn->txn_id <= kMaxTxnId) {
+    commit_log.SetState(txn->txn_id, state);
+  }
+}
+
+void Database::FinishTxn(Transaction* txn, TransactionState state) {
+  // Read-only transactions in reader registry only need to leave it.
+  if (txn->reader_slot != Transaction::kNoReaderSlot) {
+    txn->state = state;
+    reader_slots[txn->reader_slot] = kInvalidTxnId;
+    return;
+  }
+  std::lock_guard lck(active_txns_mutex);
+  SetTxnState(txn, state);
+  active_txns.erase(txn->txn_id);
+  if (state == TransactionState::kCommitted && !txn->write_set.empty()
+      && next_txn_id > txn->txn_id + 1) {
+    late_committers.emplace_back(next_txn_id, txn->txn_id);
+  }
+  // Historical snapshots as of txn ids before history watermark are
+  // rejected, so they never need committers finished by then.
+  const TxnId history_watermark = gc_history_watermark;
+  while (!late_committers.empty()
+         && late_committers.front().first <= history_watermark) {
+    late_committers.pop_front();
+  }
+}
+
+TransactionState Database::GetStartTxnState(
+    const ValueWrapper& value_wrapper) const {
+  if (value_wrapper.hint_bits & ValueWrapper::kStartCommitted) {
+    return TransactionState::kCommitted;
+  }
+  if (value_wrapper.hint_bits & ValueWrapper::kStartAborted) {
+    return TransactionState::kAborted;
+  }
+  const auto state = GetTxnState(value_wrapper.start_txn_id);
+  if (state == TransactionState::kCommitted) {
+    value_wrapper.hint_bits |= ValueWrapper::kStartCommitted;
+  } else if (state == TransactionState::kAborted) {
+    value_wrapper.hint_bits |= ValueWrapper::kStartAborted;
+  }
+  return state;
+}
+
+template <typename Policy>
+bool Database::IsVisible(const ValueWrapper& value_wrapper, Transaction* txn) {
+  if constexpr (Policy::kSnapshotRead) {
+    return IsVisibleForRepeatableRead(value_wrapper, txn);
+  } else {
+    return IsVisibleForReadCommitted(value_wrapper, txn);
+  }
+}
+
+template <typename Policy>
+const ValueWrapper* Database::GetVisibleVersion(const VersionChain& chain,
+                                                Transaction* txn) {
+  const ValueWrapper* visible_version = nullptr;
+  uint64_t scanned_num = 0;
+  for (const ValueWrapper* version = chain.head.get(); version != nullptr;
+       version = version->older.get()) {
+    ++scanned_num;
+    if (IsVisible<Policy>(*version, txn)) {
+      visible_version = version;
+      break;
     }
   }
+  auto* stats = GetThreadStats();
+  ThreadStats::Add(&stats->read_num);
+  ThreadStats::Add(&stats->scanned_version_num, scanned_num);
+  ThreadStats::Add(
+      &stats->scanned_version_histogram[DatabaseStats::GetBucket(scanned_num)]);
+  return visible_version;
+}
 
-  return false;
+const ValueWrapper* Database::ReadVersion(VersionChain* chain,
+                                          Transaction* txn) {
+  return WithIsolationPolicy(txn->isolation_level, [&](auto policy) {
+    return ReadVersion<decltype(policy)>(chain, txn);
+  });
+}
+
+template <typename Policy>
+const ValueWrapper* Database::ReadVersion(VersionChain* chain,
+                                          Transaction* txn) {
+  const auto* version = GetVisibleVersion<Policy>(*chain, txn);
+  if constexpr (Policy::kTrackConflict) {
+    TrackSerializableRead(chain, txn, version);
+  }
+  return version;
+}
+
+void Database::InternKey(StorageShard* shard, std::string_view key) {
+  std::unique_lock shard_lck(shard->mutex);
+  CreateChain(shard, KeyType(key));
+}
+
+std::pair<VersionChain*, const KeyType*> Database::CreateChain(
+    StorageShard* shard, KeyType key) {
+  // The chain could have been created concurrently.
+  auto [key_iter, inserted] = shard->chains.try_emplace(std::move(key));
+  auto& chain = key_iter->second;
+  if (inserted) {
+    chain = std::make_unique<VersionChain>();
+  }
+  return {chain.get(), &key_iter->first};
+}
+
+bool Database::WriteVersion(VersionChain* chain, VersionPool* pool,
+                            const KeyType* key, Transaction* txn,
+                            ValueType&& value, bool is_deleted) {
+  PruneVersions(chain, gc_low_watermark, gc_history_watermark);
+  // Deletion depends on whether the key exists.
+  if (is_deleted) {
+    const auto* version = ReadVersion(chain, txn);
+    if (version == nullptr || version->is_deleted) {
+      return false;
+    }
+  }
+
+  // Check conflicts eagerly before installing a new version; overwriting its
+  // own head means current transaction has passed the check already.
+  const auto policy = write_conflict_policy_.load();
+  const bool check_conflict =
+      policy != WriteConflictPolicy::kAtCommit
+      && (txn->isolation_level == IsolationLevel::kSnapshotIsolation
+          || txn->isolation_level == IsolationLevel::kSerializableIsolation)
+      && (chain->head == nullptr || chain->head->start_txn_id != txn->txn_id);
+  if (check_conflict) {
+    const TxnId writer_txn_id = FindConcurrentWriter(*chain, txn);
+    if (writer_txn_id != kInvalidTxnId) {
+      // Only an older transaction waits, for a writer which could still abort.
+      if (policy == WriteConflictPolicy::kWaitDie
+          && txn->txn_id < writer_txn_id
+          && GetTxnState(writer_txn_id) == TransactionState::kInProgress) {
+        txn->wait_txn_id = writer_txn_id;
+      } else {
+        txn->write_conflict = true;
+      }
+      return false;
+    }
+  }
+
+  // Writing into an empty chain inserts the key, whether the chain is newly
+  // created, interned by readers, or left by pruned versions.
+  const bool is_insert = chain->head == nullptr;
+  if (InstallVersion(chain, pool, txn, std::move(value), is_deleted)) {
+    txn->write_set.emplace_back(chain, key);
+  }
+  if (txn->isolation_level == IsolationLevel::kSerializableIsolation) {
+    if (is_insert) {
+      TrackSerializableInsert(*key, txn);
+    }
+    TrackSerializableWrite(chain, txn);
+  }
+  return true;
+}
+
+bool Database::InstallVersion(VersionChain* chain, VersionPool* pool,
+                              Transaction* txn, ValueType&& value,
+                              bool is_deleted) {
+  auto& head = chain->head;
+  const bool is_new = head == nullptr || head->start_txn_id != txn->txn_id;
+  if (is_new) {
+    assert(txn->txn_id <= kMaxTxnId);
+    auto version = pool->Allocate();
+    version->start_txn_id = txn->txn_id;
+    version->older = std::move(head);
+    head = std::move(version);
+  }
+  head->value = std::move(value);
+  head->is_deleted = is_deleted;
+  return is_new;
+}
+
+const ValueWrapper* Database::MoveToCommitOrder(VersionChain* chain,
+                                                TxnId txn_id) {
+  // Without first-committer-wins, a concurrent writer could have installed
+  // on top of current transaction and committed first.
+  VersionPtr own;
+  VersionPtr* cur = &chain->head;
+  while (*cur != nullptr) {
+    if ((*cur)->start_txn_id != txn_id) {
+      cur = &(*cur)->older;
+    } else if (own == nullptr) {
+      own = std::move(*cur);
+      *cur = std::move(own->older);
+    } else {
+      UnlinkVersion(cur);
+    }
+  }
+  assert(own != nullptr);
+  own->older = std::move(chain->head);
+  chain->head = std::move(own);
+  return chain->head.get();
+}
+
+TxnId Database::FindConcurrentWriter(const VersionChain& chain,
+                                     Transaction* txn) {
+  // All committed writers have stamped the chain.
+  const TxnId stamp = chain.last_writer_txn_id;
+  if (stamp != kInvalidTxnId && !txn->snapshot.HasFinished(stamp)) {
+    return stamp;
+  }
+  // In-progress writers install on top of the latest committed version.
+  for (const ValueWrapper* version = chain.head.get(); version != nullptr;
+       version = version->older.get()) {
+    if (version->start_txn_id == txn->txn_id) {
+      continue;
+    }
+    const auto state = GetStartTxnState(*version);
+    if (state == TransactionState::kInProgress) {
+      return version->start_txn_id;
+    }
+    if (state == TransactionState::kCommitted) {
+      break;
+    }
+  }
+  return kInvalidTxnId;
+}
+
+bool Database::WaitForWriter(Transaction* txn) {
+  const TxnId writer_txn_id =
+      std::exchange(txn->wait_txn_id, kInvalidTxnId);
+  if (writer_txn_id == kInvalidTxnId) {
+    return false;
+  }
+  // Back off exponentially, since the writer could be a long transaction.
+  constexpr auto kMaxBackoff = std::chrono::milliseconds(1);
+  std::chrono::microseconds backoff(1);
+  while (GetTxnState(writer_txn_id) == TransactionState::kInProgress) {
+    std::this_thread::sleep_for(backoff);
+    backoff = std::min<std::chrono::microseconds>(backoff * 2, kMaxBackoff);
+  }
+  return true;
+}
+
+TxnId Database::GetHistoryWatermark(TxnId low_watermark) {
+  const uint64_t retention = history_retention_;
+  std::shared_lock lck(active_txns_mutex);
+  const TxnId retained_txn_id =
+      next_txn_id > retention ? next_txn_id - retention : kInvalidTxnId;
+  return std::min(low_watermark, retained_txn_id);
+}
+
+TxnId Database::GetNextTxnId() {
+  std::shared_lock lck(active_txns_mutex);
+  return next_txn_id;
+}
+
+TxnId Database::GetLowWatermark() {
+  std::shared_lock lck(active_txns_mutex);
+  TxnId low_watermark = next_txn_id;
+  for (const auto& [_, xmin] : active_txns) {
+    low_watermark = std::min(low_watermark, xmin);
+  }
+  for (const auto& reader_xmin : reader_slots) {
+    const TxnId xmin = reader_xmin;
+    if (xmin != kInvalidTxnId) {
+      low_watermark = std::min(low_watermark, xmin);
+    }
+  }
+  return low_watermark;
+}
+
+void Database::TrackSerializableRead(VersionChain* chain, Transaction* txn,
+                                     const ValueWrapper* visible) {
+  auto& siread_txn_ids = chain->siread_txn_ids;
+  if (std::find(siread_txn_ids.begin(), siread_txn_ids.end(), txn->txn_id)
+      == siread_txn_ids.end()) {
+    siread_txn_ids.emplace_back(txn->txn_id);
+  }
+
+  // Newer versions skipped by current transaction are written by concurrent
+  // ones, if not aborted.
+  if (chain->head.get() == visible) {
+    return;
+  }
+  std::lock_guard lck(ssi_mutex);
+  for (const ValueWrapper* version = chain->head.get(); version != visible;
+       version = version->older.get()) {
+    if (version->start_txn_id == txn->txn_id
+        || GetStartTxnState(*version) == TransactionState::kAborted) {
+      continue;
+    }
+    auto iter = ssi_txns.find(version->start_txn_id);
+    if (iter != ssi_txns.end()) {
+      AddRwConflict(txn, iter->second.get());
+    }
+  }
+}
+
+void Database::TrackSerializableWrite(VersionChain* chain, Transaction* txn) {
+  if (chain->siread_txn_ids.empty()) {
+    return;
+  }
+  std::lock_guard lck(ssi_mutex);
+  for (const TxnId reader_txn_id : chain->siread_txn_ids) {
+    // Readers finished before current snapshot are not concurrent.
+    if (reader_txn_id == txn->txn_id
+        || txn->snapshot.HasFinished(reader_txn_id)
+        || GetTxnState(reader_txn_id) == TransactionState::kAborted) {
+      continue;
+    }
+    auto iter = ssi_txns.find(reader_txn_id);
+    if (iter != ssi_txns.end()) {
+      AddRwConflict(iter->second.get(), txn);
+    }
+  }
+}
+
+void Database::TrackSerializableRangeRead(Transaction* txn, KeyType begin,
+                                          KeyType end) {
+  std::lock_guard lck(ssi_mutex);
+  txn->read_range_fingerprint.Add(begin, end);
+  AddRange(&txn->read_ranges, std::move(begin), std::move(end));
+}
+
+void Database::TrackSerializableInsert(const KeyType& key, Transaction* txn) {
+  // Most readers' ranges are ruled out by fingerprint, hashed once for all.
+  const auto key_hashes = RangeFingerprint::HashKey(key);
+  std::lock_guard lck(ssi_mutex);
+  for (const auto& [reader_txn_id, reader] : ssi_txns) {
+    if (reader_txn_id == txn->txn_id || reader->read_ranges.empty()
+        || txn->snapshot.HasFinished(reader_txn_id)
+        || reader->state == TransactionState::kAborted) {
+      continue;
+    }
+    if (reader->read_range_fingerprint.MayContain(key_hashes)
+        && RangesContain(reader->read_ranges, key)) {
+      AddRwConflict(reader.get(), txn);
+    }
+  }
+}
+
+void Database::AddRwConflict(Transaction* reader, Transaction* writer) {
+  reader->out_conflict = true;
+  writer->in_conflict = true;
+  // A committed transaction with both conflicts cannot be aborted any more,
+  // so the other one has to.
+  if (reader->state == TransactionState::kCommitted && reader->in_conflict) {
+    writer->doomed = true;
+  }
+  if (writer->state == TransactionState::kCommitted && writer->out_conflict) {
+    reader->doomed = true;
+  }
+}
+
+void Database::PruneVersions(VersionChain* chain, TxnId low_watermark,
+                             TxnId history_watermark) {
+  // SIREAD markers only matter for transactions concurrent with the reader,
+  // which are all in progress for a finished reader before low watermark.
+  auto& siread_txn_ids = chain->siread_txn_ids;
+  siread_txn_ids.erase(
+      std::remove_if(siread_txn_ids.begin(), siread_txn_ids.end(),
+                     [this, low_watermark](TxnId reader_txn_id) {
+                       const auto state = GetTxnState(reader_txn_id);
+                       return state == TransactionState::kAborted
+                           || (state == TransactionState::kCommitted
+                               && reader_txn_id < low_watermark);
+                     }),
+      siread_txn_ids.end());
+
+  VersionPtr* cur = &chain->head;
+  while (*cur != nullptr) {
+    ValueWrapper* version = cur->get();
+    const auto state = GetStartTxnState(*version);
+
+    // Values written by aborted transactions are never visible.
+    if (state == TransactionState::kAborted) {
+      UnlinkVersion(cur);
+      continue;
+    }
+
+    // Values committed before history watermark are visible to all
+    // in-progress and future transactions, as well as historical snapshots
+    // within retention, which shadow all older ones.
+    if (state == TransactionState::kCommitted
+        && version->start_txn_id < history_watermark) {
+      ReleaseVersions(std::move(version->older));
+      // The key is fully dead if the newest version is a tombstone.
+      if (version->is_deleted && cur == &chain->head) {
+        chain->head.reset();
+      }
+      return;
+    }
+
+    cur = &version->older;
+  }
+}
+
+void Database::EraseEmptyChains(StorageShard* shard,
+                                const std::vector<KeyType>& keys) {
+  std::unique_lock shard_lck(shard->mutex);
+  for (const auto& key : keys) {
+    auto iter = shard->chains.find(key);
+    // Check again, since the key could be written or read meanwhile.
+    if (iter != shard->chains.end() && iter->second->head == nullptr
+        && iter->second->siread_txn_ids.empty()) {
+      shard->chains.erase(iter);
+    }
+  }
+}
+
+void Database::OnTxnFinished() {
+  const uint64_t gc_interval = gc_interval_;
+  if (gc_interval == 0 || ++finished_txn_num_ % gc_interval != 0) {
+    return;
+  }
+  // Skip if another thread is collecting garbage.
+  std::unique_lock gc_lck(gc_mutex, std::try_to_lock);
+  if (gc_lck.owns_lock()) {
+    RunGcStep();
+  }
+}
+
+void Database::RunGc() {
+  std::lock_guard gc_lck(gc_mutex);
+  for (size_t idx = 0; idx < kStorageShardNum; ++idx) {
+    RunGcStep();
+  }
+}
+
+void Database::RunGcStep() {
+  const TxnId low_watermark = GetLowWatermark();
+  gc_low_watermark = low_watermark;
+  // History only accumulates after retention is extended.
+  const TxnId history_watermark =
+      std::max(GetHistoryWatermark(low_watermark), gc_history_watermark.load());
+  gc_history_watermark = history_watermark;
+
+  auto& shard = storage[gc_next_shard];
+  auto& chain_length_histogram = gc_chain_length_histograms[gc_next_shard];
+  chain_length_histogram.fill(0);
+  std::vector<KeyType> empty_keys;
+  {
+    std::shared_lock shard_lck(shard.mutex);
+    for (auto& [key, chain] : shard.chains) {
+      std::lock_guard chain_lck(chain->latch);
+      PruneVersions(chain.get(), low_watermark, history_watermark);
+      uint64_t chain_length = 0;
+      for (const ValueWrapper* version = chain->head.get();
+           version != nullptr; version = version->older.get()) {
+        ++chain_length;
+      }
+      ++chain_length_histogram[DatabaseStats::GetBucket(chain_length)];
+      if (chain->head == nullptr) {
+        empty_keys.emplace_back(key);
+      }
+    }
+  }
+  if (!empty_keys.empty()) {
+    EraseEmptyChains(&shard, empty_keys);
+  }
+
+  gc_next_shard = (gc_next_shard + 1) % kStorageShardNum;
+  MVCC_TRACE(this, TraceEvent::kGcStep, low_watermark);
+
+  std::lock_guard ssi_lck(ssi_mutex);
+  for (auto iter = ssi_txns.begin(); iter != ssi_txns.end();) {
+    if (iter->first < low_watermark
+        && iter->second->state != TransactionState::kInProgress) {
+      iter = ssi_txns.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+size_t DatabaseStats::GetBucket(uint64_t value) {
+  size_t bucket = 0;
+  while (value != 0 && bucket + 1 < kHistogramBucketNum) {
+    value >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
+
+uint64_t Database::GetNextStatsId() {
+  static std::atomic<uint64_t> next_stats_id{1};
+  return next_stats_id.fetch_add(1, std::memory_order_relaxed);
+}
+
+Database::ThreadStats* Database::GetThreadStats() {
+  // Cache databases used by current thread, so threads alternating between
+  // a few databases, eg, partitions or primary and replicas, rarely look up
+  // the registry. Directly mapped by stats id, which is never reused, so a
+  // stale entry of a destroyed database never matches.
+  struct CachedStats {
+    uint64_t stats_id = 0;
+    ThreadStats* stats = nullptr;
+  };
+  static constexpr size_t kCacheSize = 16;
+  thread_local std::array<CachedStats, kCacheSize> cache{};
+  auto& cached = cache[stats_id % kCacheSize];
+  if (cached.stats_id == stats_id) {
+    return cached.stats;
+  }
+  std::lock_guard lck(stats_mutex);
+  auto& stats = thread_stats[std::this_thread::get_id()];
+  if (stats == nullptr) {
+    stats = std::make_unique<ThreadStats>();
+  }
+  cached.stats_id = stats_id;
+  cached.stats = stats.get();
+  return cached.stats;
+}
+
+DatabaseStats Database::GetStats() {
+  DatabaseStats result;
+  const auto load = [](const ThreadStats::Counter& counter) {
+    return counter.load(std::memory_order_relaxed);
+  };
+  {
+    std::lock_guard lck(stats_mutex);
+    for (const auto& [_, stats] : thread_stats) {
+      result.begin_num += load(stats->begin_num);
+      result.read_only_begin_num += load(stats->read_only_begin_num);
+      result.commit_num += load(stats->commit_num);
+      result.user_abort_num += load(stats->user_abort_num);
+      result.write_conflict_abort_num += load(stats->write_conflict_abort_num);
+      result.serialization_abort_num += load(stats->serialization_abort_num);
+      result.read_num += load(stats->read_num);
+      result.scanned_version_num += load(stats->scanned_version_num);
+      for (size_t idx = 0; idx < DatabaseStats::kHistogramBucketNum; ++idx) {
+        result.scanned_version_histogram[idx] +=
+            load(stats->scanned_version_histogram[idx]);
+        result.commit_latency_us_histogram[idx] +=
+            load(stats->commit_latency_us_histogram[idx]);
+      }
+    }
+  }
+  {
+    std::lock_guard gc_lck(gc_mutex);
+    for (const auto& histogram : gc_chain_length_histograms) {
+      for (size_t idx = 0; idx < DatabaseStats::kHistogramBucketNum; ++idx) {
+        result.chain_length_histogram[idx] += histogram[idx];
+      }
+    }
+  }
+  const TxnId low_watermark = gc_low_watermark;
+  TxnId next_txn_id_snapshot = kInvalidTxnId;
+  {
+    std::shared_lock lck(active_txns_mutex);
+    next_txn_id_snapshot = next_txn_id;
+  }
+  result.gc_backlog_txn_num = next_txn_id_snapshot > low_watermark
+      ? next_txn_id_snapshot - low_watermark : 0;
+  return result;
+}
+
+size_t Database::GetVersionNum() {
+  size_t version_num = 0;
+  for (auto& shard : storage) {
+    std::shared_lock shard_lck(shard.mutex);
+    for (auto& [_, chain] : shard.chains) {
+      std::lock_guard chain_lck(chain->latch);
+      for (const ValueWrapper* version = chain->head.get();
+           version != nullptr; version = version->older.get()) {
+        ++version_num;
+      }
+    }
+  }
+  return version_num;
 }
 
 // Two visible case:
@@ -71,20 +1011,13 @@ bool Database::HasReadWriteConflict(Transaction* txn1, Transaction* txn2) {
 // than current one.
 bool Database::IsVisibleForReadCommitted(
     const ValueWrapper& value_wrapper, Transaction* txn) {
-  // Case-1: if the value is deleted or overwritten by current transaction.
-  if (value_wrapper.end_txn_id == txn->txn_id) {
-    return false;
-  }
-
-  // Case-2: current transaction write the value.
+  // Case-1: current transaction write the value.
   if (value_wrapper.start_txn_id == txn->txn_id) {
     return true;
   }
 
-  // Case-3: start transaction has been committed, whether what
-  // end transaction state is.
-  if (db_txns.at(value_wrapper.start_txn_id)->state
-      == TransactionState::kCommitted) {
+  // Case-2: start transaction has been committed.
+  if (GetStartTxnState(value_wrapper) == TransactionState::kCommitted) {
     return true;
   }
 
@@ -92,153 +1025,693 @@ bool Database::IsVisibleForReadCommitted(
 }
 
 // Two visible cases:
-// 1. The value starts before current transaction, and already committed.
-// 2. The value doesn't ends, or ends from an uncommitted transaction.
+// 1. The value starts from self.
+// 2. The value starts from a transaction committed before current snapshot.
 bool Database::IsVisibleForRepeatableRead(
     const ValueWrapper& value_wrapper, Transaction* txn) {
-  // Case-1: if the value is deleted or overwritten by current transaction.
-  if (value_wrapper.end_txn_id == txn->txn_id) {
-    return false;
+  // Case-1: current transaction writes the value.
+  if (value_wrapper.start_txn_id == txn->txn_id) {
+    return true;
   }
 
-  // Case-2: current transaction writes the value.
-  if (value_wrapper.start_txn_id == txn->txn_id) {
+  // Case-2: value starts from a transaction committed before current
+  // snapshot; transactions in progress or not started yet are invisible.
+  if (txn->snapshot.HasFinished(value_wrapper.start_txn_id)
+      && GetStartTxnState(value_wrapper) == TransactionState::kCommitted) {
     return true;
   }
 
-  // Case-3: value starts before current transaction, and has been committed or
-  // didn't end (aka, not overwritten).
-  if (value_wrapper.start_txn_id < txn->txn_id
-      && db_txns.at(value_wrapper.start_txn_id)->state
-      == TransactionState::kCommitted) {
-    // Case-3-1: value doesn't get overwritten.
-    if (value_wrapper.end_txn_id == kInvalidTxnId) {
-      return true;
+  return false;
+}
+
+std::optional<ValueType> Connection::Get(std::string_view key) {
+  const auto value = GetView(key);
+  if (!value.has_value()) {
+    return std::nullopt;
+  }
+  return ValueType(*value);
+}
+
+std::optional<std::string_view> Connection::GetView(std::string_view key) {
+  auto& shard = db->GetShard(key);
+  std::shared_lock shard_lck(shard.mutex);
+  auto key_iter = shard.chains.find(key);
+  // Serializable transactions intern the absent key to track the read; GC
+  // could drop the chain before it's marked, then intern again.
+  while (key_iter == shard.chains.end()) {
+    if (txn->isolation_level != IsolationLevel::kSerializableIsolation) {
+      return std::nullopt;
     }
+    shard_lck.unlock();
+    db->InternKey(&shard, key);
+    shard_lck.lock();
+    key_iter = shard.chains.find(key);
+  }
 
-    // Case-3-2: value gets overwritten by an uncommited transaction.
-    if (value_wrapper.end_txn_id != kInvalidTxnId
-        && db_txns.at(value_wrapper.end_txn_id)->state
-        != TransactionState::kCommitted) {
-      return true;
+  auto& chain = *key_iter->second;
+  std::lock_guard chain_lck(chain.latch);
+  const auto* version = db->ReadVersion(&chain, txn.get());
+  if (version == nullptr || version->is_deleted) {
+    return std::nullopt;
+  }
+  return version->value.view();
+}
+
+std::vector<std::optional<ValueType>> Connection::MultiGet(
+    const std::vector<std::string_view>& keys) {
+  std::vector<std::optional<ValueType>> values(keys.size());
+  std::vector<std::pair<size_t, size_t>> order;
+  order.reserve(keys.size());
+  for (size_t idx = 0; idx < keys.size(); ++idx) {
+    order.emplace_back(Database::GetShardIndex(keys[idx]), idx);
+  }
+  SortByShardAndKey(&order, [&keys](size_t idx) { return keys[idx]; });
+
+  std::vector<size_t> absent_idxs;
+  for (size_t pos = 0; pos < order.size();) {
+    const size_t shard_idx = order[pos].first;
+    auto& shard = db->storage[shard_idx];
+    std::shared_lock shard_lck(shard.mutex);
+    for (; pos < order.size() && order[pos].first == shard_idx; ++pos) {
+      const size_t idx = order[pos].second;
+      auto key_iter = shard.chains.find(keys[idx]);
+      if (key_iter == shard.chains.end()) {
+        if (txn->isolation_level == IsolationLevel::kSerializableIsolation) {
+          absent_idxs.emplace_back(idx);
+        }
+        continue;
+      }
+      auto& chain = *key_iter->second;
+      std::lock_guard chain_lck(chain.latch);
+      const auto* version = db->ReadVersion(&chain, txn.get());
+      if (version != nullptr && !version->is_deleted) {
+        values[idx] = ValueType(version->value.view());
+      }
     }
   }
+  // Absent keys are interned and read again like [GetView], without shard
+  // locked.
+  for (const size_t idx : absent_idxs) {
+    values[idx] = Get(keys[idx]);
+  }
+  return values;
+}
 
-  return false;
+template <typename Apply>
+bool Connection::WriteChain(KeyType key, const Apply& apply) {
+  auto& shard = db->GetShard(key);
+  while (!txn->write_conflict) {
+    bool applied = false;
+    {
+      std::shared_lock shard_lck(shard.mutex);
+      auto key_iter = shard.chains.find(key);
+      if (key_iter != shard.chains.end()) {
+        auto& chain = *key_iter->second;
+        std::lock_guard chain_lck(chain.latch);
+        apply(&chain, &shard.pool, &key_iter->first);
+        applied = true;
+      }
+    }
+
+    // Slow path: first write for [key], which requires exclusive access to
+    // the shard.
+    if (!applied) {
+      std::unique_lock shard_lck(shard.mutex);
+      auto [chain, stored_key] = db->CreateChain(&shard, std::move(key));
+      std::lock_guard chain_lck(chain->latch);
+      apply(chain, &shard.pool, stored_key);
+      // Chain has been created concurrently, keep the key for retry.
+      if (txn->wait_txn_id != kInvalidTxnId) {
+        key = *stored_key;
+      }
+    }
+
+    if (!db->WaitForWriter(txn.get())) {
+      break;
+    }
+  }
+  return !txn->write_conflict;
 }
 
-bool Database::IsVisible(const ValueWrapper& value_wrapper, Transaction* txn) {
-  if (txn->isolation_level == IsolationLevel::kReadCommittedIsolation) {
-    return IsVisibleForReadCommitted(value_wrapper, txn);
+bool Connection::Set(KeyType key, ValueType value) {
+  assert(!txn->read_only);
+  return WriteChain(std::move(key), [&](VersionChain* chain, VersionPool* pool,
+                                        const KeyType* stored_key) {
+    db->WriteVersion(chain, pool, stored_key, txn.get(), std::move(value),
+                     /*is_deleted=*/false);
+  });
+}
+
+bool Connection::Delete(std::string_view key) {
+  assert(!txn->read_only);
+  auto& shard = db->GetShard(key);
+  while (!txn->write_conflict) {
+    {
+      std::shared_lock shard_lck(shard.mutex);
+      auto key_iter = shard.chains.find(key);
+      if (key_iter == shard.chains.end()) {
+        // Deletion reads the key, so serializable transactions intern the
+        // absent key to track the read like [GetView].
+        if (txn->isolation_level != IsolationLevel::kSerializableIsolation) {
+          return false;
+        }
+        shard_lck.unlock();
+        db->InternKey(&shard, key);
+        continue;
+      }
+      auto& chain = *key_iter->second;
+      std::lock_guard chain_lck(chain.latch);
+      if (db->WriteVersion(&chain, &shard.pool, &key_iter->first, txn.get(),
+                           ValueType{}, /*is_deleted=*/true)) {
+        return true;
+      }
+    }
+    if (!db->WaitForWriter(txn.get())) {
+      break;
+    }
   }
-  return IsVisibleForRepeatableRead(value_wrapper, txn);
+  return false;
 }
 
-std::optional<ValueType> Connection::Get(const KeyType& key) {
-  auto key_iter = db->storage.find(key);
-  if (key_iter == db->storage.end()) {
-    return std::nullopt;
+bool Connection::Write(WriteBatch batch) {
+  assert(!txn->read_only);
+  auto& writes = batch.writes_;
+  std::vector<std::pair<size_t, size_t>> order;
+  order.reserve(writes.size());
+  for (size_t idx = 0; idx < writes.size(); ++idx) {
+    order.emplace_back(Database::GetShardIndex(writes[idx].key), idx);
   }
+  SortByShardAndKey(&order, [&writes](size_t idx) {
+    return std::string_view(writes[idx].key);
+  });
 
-  txn->read_set.insert(key);
+  // Apply writes for the same key, which are adjacent in batch order, to
+  // latched [chain]. Writes before the blocked one take no effect, so it
+  // could be retried as a whole.
+  const auto apply = [this, &writes, &order](
+                         VersionChain* chain, VersionPool* pool,
+                         const KeyType* key, size_t begin, size_t end) {
+    for (size_t pos = begin; pos < end; ++pos) {
+      auto& write = writes[order[pos].second];
+      db->WriteVersion(chain, pool, key, txn.get(), std::move(write.value),
+                       write.is_deleted);
+      if (txn->write_conflict || txn->wait_txn_id != kInvalidTxnId) {
+        return;
+      }
+    }
+  };
 
-  const auto& value_wrappers = key_iter->second;
-  const auto value_num = value_wrappers.size();
-  for (int idx = value_num - 1; idx >= 0; --idx) {
-    if (db->IsVisible(value_wrappers[idx], txn.get())) {
-      return value_wrappers[idx].value;
+  for (size_t shard_begin = 0; shard_begin < order.size();) {
+    if (txn->write_conflict) {
+      return false;
+    }
+    const size_t shard_idx = order[shard_begin].first;
+    auto& shard = db->storage[shard_idx];
+    size_t shard_end = shard_begin;
+    while (shard_end < order.size() && order[shard_end].first == shard_idx) {
+      ++shard_end;
+    }
+
+    // Keys without chains, and keys blocked by in-progress writers, as
+    // ranges in [order].
+    std::vector<std::pair<size_t, size_t>> new_keys;
+    std::vector<std::pair<size_t, size_t>> blocked_keys;
+    {
+      std::shared_lock shard_lck(shard.mutex);
+      for (size_t begin = shard_begin, end = shard_begin; begin < shard_end;
+           begin = end) {
+        const auto& key = writes[order[begin].second].key;
+        while (end < shard_end && writes[order[end].second].key == key) {
+          ++end;
+        }
+        auto key_iter = shard.chains.find(key);
+        if (key_iter == shard.chains.end()) {
+          // Deleting an absent key takes no effect, so the chain is only
+          // needed for insertions, or to track the absent read for
+          // serializable transactions like [Delete].
+          const bool has_insert = std::any_of(
+              order.begin() + begin, order.begin() + end,
+              [&writes](const auto& entry) {
+                return !writes[entry.second].is_deleted;
+              });
+          if (has_insert
+              || txn->isolation_level
+                  == IsolationLevel::kSerializableIsolation) {
+            new_keys.emplace_back(begin, end);
+          }
+          continue;
+        }
+        auto& chain = *key_iter->second;
+        std::lock_guard chain_lck(chain.latch);
+        apply(&chain, &shard.pool, &key_iter->first, begin, end);
+        if (txn->write_conflict) {
+          return false;
+        }
+        if (txn->wait_txn_id != kInvalidTxnId) {
+          txn->wait_txn_id = kInvalidTxnId;
+          blocked_keys.emplace_back(begin, end);
+        }
+      }
     }
+
+    // Create all missing chains with the shard exclusively locked once.
+    if (!new_keys.empty()) {
+      std::unique_lock shard_lck(shard.mutex);
+      for (auto [begin, end] : new_keys) {
+        auto& key = writes[order[begin].second].key;
+        auto [chain, stored_key] = db->CreateChain(&shard, std::move(key));
+        std::lock_guard chain_lck(chain->latch);
+        apply(chain, &shard.pool, stored_key, begin, end);
+        if (txn->write_conflict) {
+          return false;
+        }
+        // Chain has been created concurrently, keep the key for retry.
+        if (txn->wait_txn_id != kInvalidTxnId) {
+          txn->wait_txn_id = kInvalidTxnId;
+          key = *stored_key;
+          blocked_keys.emplace_back(begin, end);
+        }
+      }
+    }
+
+    // Retry blocked keys one by one, with no lock held while waiting.
+    for (auto [begin, end] : blocked_keys) {
+      const bool written =
+          WriteChain(writes[order[begin].second].key,
+                     [&](VersionChain* chain, VersionPool* pool,
+                         const KeyType* stored_key) {
+                       apply(chain, pool, stored_key, begin, end);
+                     });
+      if (!written) {
+        return false;
+      }
+    }
+    shard_begin = shard_end;
   }
+  return !txn->write_conflict;
+}
 
-  return std::nullopt;
+ScanIterator Connection::Scan(KeyType begin, KeyType end) {
+  return ScanIterator(db, txn.get(), std::move(begin), std::move(end));
 }
 
-void Connection::Set(KeyType key, ValueType value) {
-  auto& value_wrappers = db->storage[key];
-  const auto value_num = value_wrappers.size();
-  for (int idx = value_num - 1; idx >= 0; --idx) {
-    // Mark all visible values as finish.
-    if (db->IsVisible(value_wrappers[idx], txn.get())) {
-      value_wrappers[idx].end_txn_id = txn->txn_id;
+ScanIterator::ScanIterator(Database* db, Transaction* txn, KeyType begin,
+                           KeyType end)
+    : db_(db),
+      txn_(txn),
+      begin_(std::move(begin)),
+      end_(std::move(end)),
+      cursors_(Database::kStorageShardNum) {
+  if (begin_ >= end_) {
+    return;
+  }
+  // Keys inserted into the range afterwards are detected by writers, while
+  // existing ones get SIREAD markers when visited.
+  if (txn_->isolation_level == IsolationLevel::kSerializableIsolation) {
+    db_->TrackSerializableRangeRead(txn_, begin_, end_);
+  }
+  heap_.reserve(Database::kStorageShardNum);
+  for (size_t shard_idx = 0; shard_idx < Database::kStorageShardNum;
+       ++shard_idx) {
+    if (FillCursor(shard_idx)) {
+      heap_.emplace_back(shard_idx);
     }
   }
+  std::make_heap(heap_.begin(), heap_.end(),
+                 [this](size_t lhs, size_t rhs) {
+                   return CursorGreater(lhs, rhs);
+                 });
+}
+
+const KeyType& ScanIterator::key() const {
+  const auto& cursor = cursors_[heap_.front()];
+  return cursor.pairs[cursor.pos].first;
+}
+
+const ValueType& ScanIterator::value() const {
+  const auto& cursor = cursors_[heap_.front()];
+  return cursor.pairs[cursor.pos].second;
+}
 
-  txn->write_set.insert(key);
+void ScanIterator::Next() {
+  const auto greater = [this](size_t lhs, size_t rhs) {
+    return CursorGreater(lhs, rhs);
+  };
+  std::pop_heap(heap_.begin(), heap_.end(), greater);
+  const size_t shard_idx = heap_.back();
+  auto& cursor = cursors_[shard_idx];
+  if (++cursor.pos == cursor.pairs.size() && !FillCursor(shard_idx)) {
+    heap_.pop_back();
+    return;
+  }
+  std::push_heap(heap_.begin(), heap_.end(), greater);
+}
 
-  ValueWrapper cur_value_wrapper;
-  cur_value_wrapper.value = std::move(value);
-  cur_value_wrapper.start_txn_id = txn->txn_id;
-  cur_value_wrapper.end_txn_id = kInvalidTxnId;
-  value_wrappers.emplace_back(std::move(cur_value_wrapper));
+bool ScanIterator::CursorGreater(size_t lhs, size_t rhs) const {
+  const auto& lhs_cursor = cursors_[lhs];
+  const auto& rhs_cursor = cursors_[rhs];
+  return lhs_cursor.pairs[lhs_cursor.pos].first
+      > rhs_cursor.pairs[rhs_cursor.pos].first;
 }
 
-bool Connection::Delete(const KeyType& key) {
-  auto key_iter = db->storage.find(key);
-  if (key_iter == db->storage.end()) {
+bool ScanIterator::FillCursor(size_t shard_idx) {
+  auto& cursor = cursors_[shard_idx];
+  if (cursor.exhausted) {
     return false;
   }
 
-  auto& value_wrappers = key_iter->second;
-  const auto value_num = value_wrappers.size();
-  for (int idx = value_num - 1; idx >= 0; --idx) {
-    // Mark all visible values as finish.
-    if (db->IsVisible(value_wrappers[idx], txn.get())) {
-      value_wrappers[idx].end_txn_id = txn->txn_id;
+  // Continue after the last copied key, which might have been erased.
+  KeyType last_key;
+  const bool has_last_key = !cursor.pairs.empty();
+  if (has_last_key) {
+    last_key = std::move(cursor.pairs.back().first);
+  }
+  cursor.pairs.clear();
+  cursor.pos = 0;
+
+  auto& shard = db_->storage[shard_idx];
+  std::shared_lock shard_lck(shard.mutex);
+  auto key_iter = has_last_key ? shard.chains.upper_bound(last_key)
+                               : shard.chains.lower_bound(begin_);
+  return WithIsolationPolicy(txn_->isolation_level, [&](auto policy) {
+    for (; key_iter != shard.chains.end() && key_iter->first < end_;
+         ++key_iter) {
+      if (cursor.pairs.size() == kBatchSize) {
+        return true;
+      }
+      auto& chain = *key_iter->second;
+      std::lock_guard chain_lck(chain.latch);
+      const auto* version =
+          db_->ReadVersion<decltype(policy)>(&chain, txn_);
+      if (version != nullptr && !version->is_deleted) {
+        cursor.pairs.emplace_back(key_iter->first, version->value.view());
+      }
+    }
+    cursor.exhausted = true;
+    return !cursor.pairs.empty();
+  });
+}
+
+void Connection::ForEach(
+    const std::function<void(const KeyType&, const ValueType&)>& visitor) {
+  WithIsolationPolicy(txn->isolation_level, [&](auto policy) {
+    std::vector<std::pair<KeyType, ValueType>> key_values;
+    for (auto& shard : db->storage) {
+      // Copy visible values out, so visitor doesn't block writers.
+      {
+        std::shared_lock shard_lck(shard.mutex);
+        for (const auto& [key, chain] : shard.chains) {
+          std::lock_guard chain_lck(chain->latch);
+          const auto* version =
+              db->GetVisibleVersion<decltype(policy)>(*chain, txn.get());
+          if (version != nullptr && !version->is_deleted) {
+            key_values.emplace_back(key, version->value.view());
+          }
+        }
+      }
+      for (const auto& [key, value] : key_values) {
+        visitor(key, value);
+      }
+      key_values.clear();
+    }
+  });
+}
+
+void Connection::Rollback() {
+  // Prepared transaction holds latches until it finishes.
+  prepared_locks.reset();
+
+  // Chains stay in storage while they contain versions of the in-progress
+  // transaction, so remove versions before it finishes.
+  auto& write_chains = txn->write_set;
+  std::sort(write_chains.begin(), write_chains.end());
+  write_chains.erase(std::unique(write_chains.begin(), write_chains.end()),
+                     write_chains.end());
+  std::vector<KeyType> empty_keys;
+  for (auto [chain, key] : write_chains) {
+    auto& shard = db->GetShard(*key);
+    std::shared_lock shard_lck(shard.mutex);
+    std::lock_guard chain_lck(chain->latch);
+    VersionPtr* cur = &chain->head;
+    while (*cur != nullptr) {
+      ValueWrapper* version = cur->get();
+      if (version->start_txn_id == txn->txn_id) {
+        UnlinkVersion(cur);
+      } else {
+        cur = &version->older;
+      }
+    }
+    // Keys inserted by current transaction are fully dead.
+    if (chain->head == nullptr && chain->siread_txn_ids.empty()) {
+      empty_keys.emplace_back(*key);
     }
   }
+  write_chains.clear();
+  db->FinishTxn(txn.get(), TransactionState::kAborted);
 
-  txn->write_set.insert(key);
-  return true;
+  for (const auto& key : empty_keys) {
+    db->EraseEmptyChains(&db->GetShard(key), {key});
+  }
 }
 
 void Connection::Abort() {
-  txn->state = TransactionState::kAborted;
+  Rollback();
+  auto* stats = db->GetThreadStats();
+  Database::ThreadStats::Add(txn->write_conflict
+                                 ? &stats->write_conflict_abort_num
+                                 : &stats->user_abort_num);
+  MVCC_TRACE(db, TraceEvent::kAbort, txn->txn_id);
+  // Transactions in reader registry leave no garbage.
+  if (txn->reader_slot == Transaction::kNoReaderSlot) {
+    db->OnTxnFinished();
+  }
 }
 
 bool Connection::Commit() {
-  // For repeatable read isolation level, no need to check conflicts.
-  if (txn->isolation_level == IsolationLevel::kReadCommittedIsolation
-      || txn->isolation_level == IsolationLevel::kRepeatableReadIsolation) {
-    txn->state = TransactionState::kCommitted;
+  // Nothing to validate for transactions in reader registry.
+  if (txn->reader_slot != Transaction::kNoReaderSlot) {
+    db->FinishTxn(txn.get(), TransactionState::kCommitted);
+    Database::ThreadStats::Add(&db->GetThreadStats()->commit_num);
+    MVCC_TRACE(db, TraceEvent::kCommit, txn->txn_id);
     return true;
   }
+  const auto start_time = std::chrono::steady_clock::now();
+  const bool committed =
+      WithIsolationPolicy(txn->isolation_level, [this](auto policy) {
+        return TryCommit<decltype(policy)>();
+      });
+  if (!committed) {
+    MVCC_TRACE(db, TraceEvent::kAbort, txn->txn_id);
+    db->OnTxnFinished();
+    return false;
+  }
+  WaitDurable();
+  OnCommitted(db, *txn, start_time);
+  return true;
+}
 
-  // At commit, check whether current transaction has conflict with in-progress
-  // ones at start.
-  const auto& inprogress_txns = txn->inprogress_txns;
-  for (const TxnId cur_txn_id : inprogress_txns) {
-    const auto& another_txn = db->db_txns.at(cur_txn_id);
-    // Check conflict for snapshot isolation.
-    if (txn->isolation_level == IsolationLevel::kSnapshotIsolation) {
-      if (another_txn->state != TransactionState::kCommitted) {
-        continue;
-      }
-      if (db->HasWriteConflict(txn.get(), another_txn.get())) {
-        Abort();
-        return false;
-      }
-      continue;
+void Connection::CommitAsync(std::function<void(bool)> done) {
+  if (txn->reader_slot != Transaction::kNoReaderSlot) {
+    done(Commit());
+    return;
+  }
+  const auto start_time = std::chrono::steady_clock::now();
+  const bool committed =
+      WithIsolationPolicy(txn->isolation_level, [this](auto policy) {
+        return TryCommit<decltype(policy)>();
+      });
+  if (!committed) {
+    MVCC_TRACE(db, TraceEvent::kAbort, txn->txn_id);
+    db->OnTxnFinished();
+    done(false);
+    return;
+  }
+  if (txn->commit_lsn == 0) {
+    OnCommitted(db, *txn, start_time);
+    done(true);
+    return;
+  }
+  // Connection might be gone by the time it's durable, keep the transaction.
+  db->durability_policy->OnDurable(
+      txn->commit_lsn,
+      [db = db, txn = txn, start_time, done = std::move(done)]() {
+        OnCommitted(db, *txn, start_time);
+        done(true);
+      });
+}
+
+void Connection::OnCommitted(
+    Database* db, [[maybe_unused]] const Transaction& txn,
+    std::chrono::steady_clock::time_point start_time) {
+  const auto latency_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start_time).count();
+  auto* stats = db->GetThreadStats();
+  Database::ThreadStats::Add(&stats->commit_num);
+  Database::ThreadStats::Add(&stats->commit_latency_us_histogram[
+      DatabaseStats::GetBucket(latency_us)]);
+  MVCC_TRACE(db, TraceEvent::kCommit, txn.txn_id);
+  db->OnTxnFinished();
+}
+
+template <typename Policy>
+bool Connection::TryCommit() {
+  {
+    CommitLocks locks;
+    if (Validate<Policy>(&locks)) {
+      Publish();
+      return true;
     }
+  }
+  Rollback();
+  return false;
+}
 
-    // Check conflict for serializable isolation.
-    if (txn->isolation_level == IsolationLevel::kSerializableIsolation) {
-      if (db->HasWriteConflict(txn.get(), another_txn.get())) {
-        Abort();
-        return false;
-      }
-      if (db->HasReadWriteConflict(txn.get(), another_txn.get())) {
-        return false;
+template <typename Policy>
+bool Connection::Validate(CommitLocks* locks) {
+  // Chains for written keys always exist, since they contain uncommitted
+  // versions. Latch all of them in address order.
+  auto& write_chains = txn->write_set;
+  std::sort(write_chains.begin(), write_chains.end());
+  write_chains.erase(std::unique(write_chains.begin(), write_chains.end()),
+                     write_chains.end());
+  auto& chain_lcks = locks->chain_lcks;
+  chain_lcks.reserve(write_chains.size());
+  for (auto [chain, _] : write_chains) {
+    chain_lcks.emplace_back(chain->latch);
+  }
+
+  // First-committer-wins: a stamp from a transaction not finished for current
+  // snapshot means a concurrent transaction has committed.
+  // For read committed and repeatable read isolation level, no need to check
+  // conflicts, but the write set still needs to be stamped.
+  bool has_write_conflict = txn->write_conflict;
+  if constexpr (Policy::kCheckWriteConflict) {
+    const auto& snapshot = txn->snapshot;
+    for (auto [chain, _] : write_chains) {
+      const TxnId stamp = chain->last_writer_txn_id;
+      if (stamp != kInvalidTxnId && !snapshot.HasFinished(stamp)) {
+        has_write_conflict = true;
+        break;
       }
-      continue;
     }
   }
+  bool has_conflict = has_write_conflict;
+
+  // Logged transactions only become visible with checkpoint barrier held.
+  if (db->durability_policy != nullptr && !write_chains.empty()) {
+    locks->checkpoint_lck =
+        std::shared_lock<std::shared_mutex>(db->checkpoint_mutex);
+  }
+
+  // Serializable transactions additionally abort on dangerous structure, aka,
+  // having both incoming and outgoing rw-antidependencies. Decision and state
+  // transition happen atomically against new conflicts.
+  if constexpr (Policy::kTrackConflict) {
+    locks->ssi_lck = std::unique_lock<std::mutex>(db->ssi_mutex);
+    has_conflict = has_write_conflict || txn->doomed
+        || (txn->in_conflict && txn->out_conflict);
+  }
 
-  txn->state = TransactionState::kCommitted;
+  if (has_conflict) {
+    auto* stats = db->GetThreadStats();
+    Database::ThreadStats::Add(has_write_conflict
+                                   ? &stats->write_conflict_abort_num
+                                   : &stats->serialization_abort_num);
+    return false;
+  }
   return true;
 }
 
+void Connection::Publish() {
+  // Order versions by commit like the log, and log the write set before it
+  // becomes visible, so replay ends up with what readers see.
+  const auto& write_chains = txn->write_set;
+  const bool logged =
+      db->durability_policy != nullptr && !write_chains.empty();
+  std::vector<WriteRecord> writes;
+  writes.reserve(logged ? write_chains.size() : 0);
+  for (auto [chain, key] : write_chains) {
+    const ValueWrapper* version = db->MoveToCommitOrder(chain, txn->txn_id);
+    if (logged) {
+      writes.emplace_back(WriteRecord{
+          *key, ValueType(version->value.view()), version->is_deleted});
+    }
+  }
+  if (logged) {
+    txn->commit_lsn = db->durability_policy->Append(txn->txn_id, writes);
+  }
+
+  // Stamp written chains before leaving active transactions, as
+  // [VersionChain::last_writer_txn_id] requires.
+  for (auto [chain, _] : write_chains) {
+    chain->last_writer_txn_id = txn->txn_id;
+  }
+  db->FinishTxn(txn.get(), TransactionState::kCommitted);
+}
+
+bool Connection::Prepare() {
+  // Nothing to validate for transactions in reader registry.
+  if (txn->reader_slot != Transaction::kNoReaderSlot) {
+    return true;
+  }
+  prepared_locks = std::make_unique<CommitLocks>();
+  const bool prepared =
+      WithIsolationPolicy(txn->isolation_level, [this](auto policy) {
+        return Validate<decltype(policy)>(prepared_locks.get());
+      });
+  if (!prepared) {
+    Rollback();
+    MVCC_TRACE(db, TraceEvent::kAbort, txn->txn_id);
+    db->OnTxnFinished();
+  }
+  return prepared;
+}
+
+void Connection::CommitPrepared() {
+  if (txn->reader_slot != Transaction::kNoReaderSlot) {
+    db->FinishTxn(txn.get(), TransactionState::kCommitted);
+  } else {
+    assert(prepared_locks != nullptr);
+    Publish();
+    prepared_locks.reset();
+  }
+  Database::ThreadStats::Add(&db->GetThreadStats()->commit_num);
+  MVCC_TRACE(db, TraceEvent::kCommit, txn->txn_id);
+}
+
+void Connection::FinishCommit() {
+  WaitDurable();
+  if (txn->reader_slot == Transaction::kNoReaderSlot) {
+    db->OnTxnFinished();
+  }
+}
+
+void Connection::WaitDurable() {
+  if (txn->commit_lsn != 0) {
+    db->durability_policy->WaitDurable(txn->commit_lsn);
+  }
+}
+
+Connection::Connection(Connection&& rhs) noexcept
+    : db(rhs.db), txn(std::move(rhs.txn)),
+      prepared_locks(std::move(rhs.prepared_locks)) {}
+
+Connection& Connection::operator=(Connection&& rhs) noexcept {
+  if (this != &rhs) {
+    if (txn != nullptr && txn->state == TransactionState::kInProgress) {
+      Abort();
+    }
+    db = rhs.db;
+    txn = std::move(rhs.txn);
+    prepared_locks = std::move(rhs.prepared_locks);
+  }
+  return *this;
+}
+
 Connection::~Connection() {
-  if (txn->state == TransactionState::kInProgress) {
+  // Moved-from connection doesn't own a transaction.
+  if (txn != nullptr && txn->state == TransactionState::kInProgress) {
     Abort();
   }
 }
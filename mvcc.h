@@ -1,23 +1,35 @@
 // In-memory implementation for MVCC, for educational purpose.
 //
 // Attention:
-// 1. Assume single-threaded usage.
+// 1. Thread-safe: connections could be used from different threads at the
+// same time, though a single connection is not meant to be shared among
+// threads.
 // 2. Assume key-value data model.
 //
-// TODO:
-// 1. Add different isolation levels, currently only support snapshot isolation.
-// 2. As of now, we store all transaction in the database, whether it's
-// committed, ongoing or aborted; should consider prune expired ones.
+// Garbage collection:
+// Versions and finished transactions which no snapshot could observe are
+// pruned incrementally, based on the low watermark (the oldest txn id any
+// in-progress transaction could refer to).
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
-#include <unordered_set>
 #include <vector>
 
 namespace mvcc {
@@ -26,6 +38,9 @@ namespace mvcc {
 using TxnId = uint64_t;
 // Use 0 to indicate invalid txn-id; starting from txn-id = 1.
 constexpr TxnId kInvalidTxnId = 0;
+// Largest txn id which could write, bounded by capacity of commit log; see
+// [Database::CreateConn] for transactions beyond it.
+constexpr TxnId kMaxTxnId = UINT32_MAX;
 
 using KeyType = std::string;
 using ValueType = std::string;
@@ -38,13 +53,123 @@ enum class IsolationLevel {
   kSerializableIsolation,
 };
 
-enum class TransactionState {
+// Compile-time policy for isolation level [kLevel], which specializes hot
+// paths instead of branching on isolation level for every version visited.
+template <IsolationLevel kLevel>
+struct IsolationPolicy {
+  static constexpr IsolationLevel kIsolationLevel = kLevel;
+  // Whether reads only see transactions committed before the snapshot,
+  // otherwise the latest committed version.
+  static constexpr bool kSnapshotRead =
+      kLevel != IsolationLevel::kReadCommittedIsolation;
+  // Whether commit fails on concurrent writes, aka first-committer-wins.
+  static constexpr bool kCheckWriteConflict =
+      kLevel == IsolationLevel::kSnapshotIsolation
+      || kLevel == IsolationLevel::kSerializableIsolation;
+  // Whether reads and writes are tracked for rw-antidependencies.
+  static constexpr bool kTrackConflict =
+      kLevel == IsolationLevel::kSerializableIsolation;
+};
+
+// When write-write conflicts are detected, for transactions at snapshot
+// isolation and serializable isolation level.
+enum class WriteConflictPolicy {
+  // Only at commit, aka first-committer-wins.
+  kAtCommit,
+  // At write time as well, which fails on a concurrent writer of the key,
+  // either committed or in progress, aka first-updater-wins.
+  kNoWait,
+  // Same as [kNoWait], except an older transaction waits for a younger
+  // in-progress writer to finish instead of failing; waits only go from older
+  // to younger ones, so there're no deadlocks.
+  kWaitDie,
+};
+
+enum class TransactionState : uint8_t {
   kInvalid,
   kInProgress,
   kCommitted,
   kAborted,
 };
 
+// Transactions which have finished when a transaction starts.
+struct Snapshot {
+  // All transactions before [xmin] have finished.
+  TxnId xmin = kInvalidTxnId;
+  // No transaction since [xmax] has started, it's the owner's txn id.
+  TxnId xmax = kInvalidTxnId;
+  // Sorted in-progress transactions within [xmin, xmax).
+  std::vector<TxnId> active_txns;
+
+  // Returns whether transaction [txn_id] has finished (either committed or
+  // aborted) when the snapshot is taken.
+  bool HasFinished(TxnId txn_id) const {
+    if (txn_id < xmin) {
+      return true;
+    }
+    if (txn_id >= xmax) {
+      return false;
+    }
+    return !std::binary_search(active_txns.begin(), active_txns.end(),
+                               txn_id);
+  }
+};
+
+// Compact fingerprint of key ranges, to rule out keys outside of all of them
+// with a few word operations before an exact lookup. Keys within a range all
+// start with the common prefix of its bounds, so each range is summarized by
+// the hash of that prefix, up to [kMaxPrefixLen] bytes, in a blocked Bloom
+// filter; a range sharing no prefix matches any key.
+class RangeFingerprint {
+ public:
+  static constexpr size_t kMaxPrefixLen = 8;
+
+  // Hashes for prefixes of a key, of each length up to [kMaxPrefixLen] or
+  // the key size; computed once to probe many fingerprints.
+  struct KeyHashes {
+    std::array<uint64_t, kMaxPrefixLen + 1> prefix_hashes{};
+    size_t prefix_num = 0;
+  };
+  static KeyHashes HashKey(std::string_view key);
+
+  // Add range [begin, end).
+  void Add(std::string_view begin, std::string_view end);
+
+  // Return false if the key for [key_hashes] is definitely outside of all
+  // added ranges.
+  bool MayContain(const KeyHashes& key_hashes) const {
+    for (size_t len = 0; len < key_hashes.prefix_num; ++len) {
+      if ((prefix_lens_ & (1u << len)) == 0) {
+        continue;
+      }
+      const uint64_t hash = key_hashes.prefix_hashes[len];
+      const uint64_t mask = GetMask(hash);
+      if ((bits_[GetBlock(hash)] & mask) == mask) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  static constexpr size_t kBlockNum = 4;
+
+  // Each prefix sets two bits within a single block.
+  static size_t GetBlock(uint64_t hash) {
+    return hash >> 62;
+  }
+  static uint64_t GetMask(uint64_t hash) {
+    return (uint64_t{1} << (hash & 63)) | (uint64_t{1} << ((hash >> 6) & 63));
+  }
+
+  std::array<uint64_t, kBlockNum> bits_{};
+  // Bit [len] is set if any range has common prefix of length [len].
+  uint32_t prefix_lens_ = 0;
+};
+
+// Forward declaration.
+struct VersionChain;
+
 struct Transaction {
   TxnId txn_id = kInvalidTxnId;
 
@@ -52,74 +177,728 @@ struct Transaction {
   IsolationLevel isolation_level = IsolationLevel::kInvalid;
 
   // Ongoing transactions whether the current txn starts.
-  std::unordered_set<TxnId> inprogress_txns;
+  Snapshot snapshot;
+
+  // State for the current transaction, which could be read by other
+  // transactions concurrently.
+  std::atomic<TransactionState> state{TransactionState::kInvalid};
+
+  // Chains which current transaction has installed versions on, along with
+  // their keys owned by storage; there might be duplicates if a concurrent
+  // writer installs on top of current transaction's version in between.
+  //
+  // Chains stay in storage until current transaction finishes, since they
+  // contain its uncommitted versions, so no copy for keys is necessary.
+  std::vector<std::pair<VersionChain*, const KeyType*>> write_set;
+
+  // States for serializable snapshot isolation, guarded by database SSI mutex.
+  //
+  // Key ranges scanned by the current transaction, which might contain keys
+  // not existing yet, so SIREAD markers cannot be placed on their chains; it
+  // maps from range begin to end, ranges are half-open and disjoint. Absent
+  // keys read by point lookups are interned as chains instead.
+  std::map<KeyType, KeyType> read_ranges;
+  // Fingerprint of [read_ranges], checked by inserting writers first.
+  RangeFingerprint read_range_fingerprint;
+  //
+  // Whether there's a rw-antidependency from a concurrent transaction to the
+  // current one, aka, current one overwrites what the other one reads.
+  bool in_conflict = false;
+  // Whether there's a rw-antidependency from the current transaction to a
+  // concurrent one, aka, the other one overwrites what current one reads.
+  bool out_conflict = false;
+  // Whether the current transaction has to abort at commit, since a committed
+  // concurrent transaction has become a pivot of dangerous structure.
+  bool doomed = false;
+
+  // Whether a write-write conflict has been detected at write time, so the
+  // current transaction has to abort; further writes fail at once.
+  bool write_conflict = false;
+  // In-progress writer which a write by current transaction waits for, before
+  // it could be retried.
+  TxnId wait_txn_id = kInvalidTxnId;
 
-  // State for the current transaction.
-  TransactionState state = TransactionState::kInvalid;
+  // Log sequence number returned by durability policy at commit, 0 if the
+  // transaction isn't logged.
+  uint64_t commit_lsn = 0;
 
-  // Keys for write.
-  std::unordered_set<KeyType> write_set;
+  // Whether the transaction only reads.
+  bool read_only = false;
+  // Slot in database reader registry, for read-only transactions which don't
+  // have a txn id and are not in active transactions.
+  static constexpr size_t kNoReaderSlot = SIZE_MAX;
+  size_t reader_slot = kNoReaderSlot;
+};
+
+// Forward declaration.
+class VersionPool;
+struct ValueWrapper;
+
+// Returns versions to the pool they're allocated from.
+struct VersionDeleter {
+  VersionPool* pool = nullptr;
 
-  // Keys for read.
-  std::unordered_set<KeyType> read_set; 
+  void operator()(ValueWrapper* version) const;
 };
 
-// Definition for multi-version values.
+using VersionPtr = std::unique_ptr<ValueWrapper, VersionDeleter>;
+
+// Value of a version packed into 24 bytes. Values up to [kInlineCapacity]
+// bytes, eg, counters and flags, are stored inline without heap allocation,
+// so they share the cache line with version metadata; larger ones are moved
+// into a heap string, which takes over their buffer. The heap string is kept
+// once cleared, so versions recycled by [VersionPool] store later large
+// values without allocation besides the value's own buffer.
+class PackedValue {
+ public:
+  static constexpr size_t kInlineCapacity = 23;
+
+  PackedValue() = default;
+  PackedValue(const PackedValue&) = delete;
+  PackedValue& operator=(const PackedValue&) = delete;
+  ~PackedValue() {
+    if (!IsInline()) {
+      delete GetHeapValue();
+    }
+  }
+
+  PackedValue& operator=(ValueType value);
+
+  std::string_view view() const {
+    if (IsInline()) {
+      return std::string_view(bytes_, static_cast<uint8_t>(bytes_[kTagPos]));
+    }
+    return *GetHeapValue();
+  }
+
+  bool empty() const {
+    return view().empty();
+  }
+
+  // Reset to empty value, and free the value buffer if any.
+  void Clear();
+
+ private:
+  // Last byte is the size for inline values, or [kHeapTag] otherwise.
+  static constexpr size_t kTagPos = kInlineCapacity;
+  static constexpr uint8_t kHeapTag = 0xFF;
+
+  bool IsInline() const {
+    return static_cast<uint8_t>(bytes_[kTagPos]) != kHeapTag;
+  }
+
+  // Heap value's address is stored at the beginning.
+  ValueType* GetHeapValue() const {
+    ValueType* heap_value = nullptr;
+    std::memcpy(&heap_value, bytes_, sizeof(heap_value));
+    return heap_value;
+  }
+
+  alignas(ValueType*) char bytes_[kInlineCapacity + 1] = {};
+};
+
+// Definition for multi-version values, which are chained from the newest to
+// the oldest for each key.
 //
-// There're two possible time points we would set end txn id:
-// 1. A key-value pair is explicitly committed;
-// 2. A new value overwrites with the current txn id.
+// A value is visible to a transaction, if it's the newest one whose start
+// transaction is visible; deletion is represented by a tombstone value.
 struct ValueWrapper {
+  // Hint bits, which are set once the start transaction is known to be
+  // finished.
+  static constexpr uint8_t kStartCommitted = 1 << 0;
+  static constexpr uint8_t kStartAborted = 1 << 1;
+
+  PackedValue value;
+  // Writers' txn ids are up to [kMaxTxnId], so 32 bits suffice.
+  uint32_t start_txn_id = kInvalidTxnId;
+  // Whether the value is a tombstone for deletion.
+  bool is_deleted = false;
+  // Cached final state for [start_txn_id], so visibility check doesn't need
+  // to look up commit log; guarded by chain latch.
+  mutable uint8_t hint_bits = 0;
+  // Next older version.
+  VersionPtr older;
+};
+
+// Versions with small values take 48 bytes in all.
+static_assert(sizeof(ValueWrapper) <= 48);
+
+// Slab allocator for versions, which recycles released versions instead of
+// going through general-purpose heap, so steady-state writes don't allocate
+// version records. Thread-safe.
+class VersionPool {
+ public:
+  VersionPool() = default;
+  VersionPool(const VersionPool&) = delete;
+  VersionPool& operator=(const VersionPool&) = delete;
+
+  // Allocate a default-initialized version.
+  VersionPtr Allocate();
+
+  // Get the number of versions allocated and not released yet.
+  size_t GetAllocatedNum();
+
+ private:
+  friend struct VersionDeleter;
+
+  // Number of versions in one slab.
+  static constexpr size_t kSlabSize = 256;
+
+  // Reset and recycle [version], whose older versions are already released.
+  void Release(ValueWrapper* version);
+
+  std::mutex mutex_;
+  // Slabs are never freed until destruction.
+  std::vector<std::unique_ptr<ValueWrapper[]>> slabs_;
+  // Released versions available for allocation.
+  std::vector<ValueWrapper*> free_versions_;
+};
+
+// Dense transaction state log indexed by txn id, lookup is lock-free.
+//
+// States are stored in lazily allocated fixed-size segments, which are never
+// freed until destruction, so readers don't need any synchronization besides
+// atomic loads.
+class CommitLog {
+ public:
+  CommitLog() = default;
+  CommitLog(const CommitLog&) = delete;
+  CommitLog& operator=(const CommitLog&) = delete;
+  ~CommitLog();
+
+  // Set state for transaction [txn_id], allocate segment if necessary.
+  void SetState(TxnId txn_id, TransactionState state);
+
+  // Get state for transaction [txn_id], which has been set before.
+  TransactionState GetState(TxnId txn_id) const;
+
+ private:
+  using Segment = std::atomic<TransactionState>;
+
+  // Number of transaction states in one segment.
+  static constexpr size_t kSegmentSize = 1 << 18;
+  // Maximum number of segments, which covers txn ids up to [kMaxTxnId].
+  static constexpr size_t kMaxSegmentNum = 1 << 14;
+
+  // Guards segment allocation.
+  std::mutex alloc_mutex_;
+  std::array<std::atomic<Segment*>, kMaxSegmentNum> segments_{};
+};
+
+// All versions for a single key, guarded by its own latch.
+struct VersionChain {
+  VersionChain() = default;
+  // Release versions iteratively, to avoid deep recursion on long chains.
+  ~VersionChain();
+
+  std::mutex latch;
+  // Newest version.
+  VersionPtr head;
+  // Latest committed transaction which writes the key, stamped at commit.
+  //
+  // Stamp is updated with chain latched and before the committer leaves
+  // active transactions, so if the latest stamped transaction has finished
+  // for a snapshot, all previous ones have finished as well.
+  TxnId last_writer_txn_id = kInvalidTxnId;
+  // Serializable transactions which have read the key (aka, SIREAD markers),
+  // to detect rw-antidependencies with concurrent writers.
+  std::vector<TxnId> siread_txn_ids;
+};
+
+// A write by a committed transaction.
+struct WriteRecord {
+  KeyType key;
   ValueType value;
-  TxnId start_txn_id;               // Inclusive.
-  TxnId end_txn_id = kInvalidTxnId; // Inclusive.
+  // Whether the write is a deletion.
+  bool is_deleted = false;
 };
 
+// Policy to persist committed transactions, which is opt-in for [Database].
+//
+// Records are appended in commit order for conflicting transactions, which
+// is also the order their versions become visible in, so replaying them in
+// order rebuilds what readers see. They're appended before the transaction
+// becomes visible; committer then waits for durability after
+// releasing its latches, so concurrent committers could share one sync.
+class DurabilityPolicy {
+ public:
+  virtual ~DurabilityPolicy() = default;
+
+  // Append [writes] of transaction [txn_id], return the log sequence number
+  // to wait for, which is always positive.
+  virtual uint64_t Append(TxnId txn_id,
+                          const std::vector<WriteRecord>& writes) = 0;
+
+  // Block until the record at [lsn] and all previous ones are durable.
+  virtual void WaitDurable(uint64_t lsn) = 0;
+
+  // Invoke [callback] once the record at [lsn] and all previous ones are
+  // durable, without blocking the caller if possible. The callback could run
+  // on any thread, or inline if already durable; by default it blocks by
+  // [WaitDurable] and then runs inline.
+  virtual void OnDurable(uint64_t lsn, std::function<void()> callback) {
+    WaitDurable(lsn);
+    callback();
+  }
+
+  // Get the log sequence number right after all appended records.
+  virtual uint64_t GetAppendedLsn() = 0;
+};
+
+// Source of transaction ids, which could be shared by several databases, eg,
+// replicas or partitions, so their transactions are ordered in one sequence
+// without a round-trip for each transaction.
+//
+// Ids index into commit log of each database, so they should stay dense;
+// ids handed out to all databases sharing one oracle count towards
+// [kMaxTxnId] of each one.
+class TimestampOracle {
+ public:
+  virtual ~TimestampOracle() = default;
+
+  // Allocate [num] consecutive txn ids, return the first one. Ranges are
+  // disjoint and increasing across calls.
+  virtual TxnId AllocateRange(uint64_t num) = 0;
+};
+
+// Timestamp oracle handing out ranges from an in-process counter.
+class CounterTimestampOracle : public TimestampOracle {
+ public:
+  TxnId AllocateRange(uint64_t num) override {
+    return next_txn_id_.fetch_add(num);
+  }
+
+ private:
+  std::atomic<TxnId> next_txn_id_{kInvalidTxnId + 1};
+};
+
+// Statistics for a database since its creation.
+struct DatabaseStats {
+  // Bucket 0 counts value 0, and bucket i counts values within
+  // [2^(i-1), 2^i); the last bucket counts all larger values as well.
+  static constexpr size_t kHistogramBucketNum = 32;
+  using Histogram = std::array<uint64_t, kHistogramBucketNum>;
+
+  // Returns the histogram bucket for [value].
+  static size_t GetBucket(uint64_t value);
+
+  // Number of started transactions, including read-only ones.
+  uint64_t begin_num = 0;
+  // Number of started read-only transactions.
+  uint64_t read_only_begin_num = 0;
+  // Number of committed transactions.
+  uint64_t commit_num = 0;
+  // Number of transactions aborted by [Connection::Abort] or destruction,
+  // except ones with write-write conflicts detected at write time.
+  uint64_t user_abort_num = 0;
+  // Number of transactions aborted for write-write conflicts, detected either
+  // at commit or at write time.
+  uint64_t write_conflict_abort_num = 0;
+  // Number of serializable transactions aborted at commit for dangerous
+  // structures.
+  uint64_t serialization_abort_num = 0;
+
+  // Number of version chain lookups by reads and deletions.
+  uint64_t read_num = 0;
+  // Number of versions scanned by chain lookups to find the visible one.
+  uint64_t scanned_version_num = 0;
+  // Versions scanned per chain lookup.
+  Histogram scanned_version_histogram{};
+  // Version chain lengths, observed by the latest GC sweep of each shard.
+  Histogram chain_length_histogram{};
+  // Commit latency in microseconds, including waiting for durability.
+  Histogram commit_latency_us_histogram{};
+
+  // Number of transactions started since the low watermark observed by GC,
+  // whose versions cannot be reclaimed yet.
+  uint64_t gc_backlog_txn_num = 0;
+};
+
+// Events reported to trace hook.
+enum class TraceEvent {
+  kBegin,
+  kCommit,
+  kAbort,
+  kGcStep,
+};
+
+// Hook invoked on trace events, along with the transaction involved, which is
+// kInvalidTxnId for transactions in reader registry, and the low watermark for
+// GC steps. It's only invoked if built with `MVCC_ENABLE_TRACING` defined,
+// otherwise trace points are compiled out.
+using TraceHook = std::function<void(TraceEvent event, TxnId txn_id)>;
+
 // Forward declaration.
 class Database;
 
+// Writes to apply atomically with one [Connection::Write] call, in order.
+class WriteBatch {
+ public:
+  // Set [key] to [value].
+  void Set(KeyType key, ValueType value) {
+    writes_.emplace_back(WriteRecord{std::move(key), std::move(value),
+                                     /*is_deleted=*/false});
+  }
+
+  // Delete [key], which is a no-op if there's no visible value for [key].
+  void Delete(KeyType key) {
+    writes_.emplace_back(WriteRecord{std::move(key), ValueType{},
+                                     /*is_deleted=*/true});
+  }
+
+  // Get the number of writes in the batch.
+  size_t size() const {
+    return writes_.size();
+  }
+
+ private:
+  friend struct Connection;
+
+  std::vector<WriteRecord> writes_;
+};
+
+// Iterator over key-value pairs visible to a transaction within a key range,
+// in ascending key order; it's created by [Connection::Scan] and shouldn't
+// outlive the connection.
+//
+// Keys are hash partitioned into storage shards, each of which is ordered, so
+// the iterator merges per-shard cursors. Each cursor copies a small batch of
+// visible pairs at a time, so no lock is held between steps and the result
+// is never materialized as a whole; for transactions reading from a snapshot,
+// result is consistent regardless of concurrent writers.
+class ScanIterator {
+ public:
+  // Whether the iterator points to a key-value pair.
+  bool Valid() const {
+    return !heap_.empty();
+  }
+
+  // Key for the current pair, iterator should be valid.
+  const KeyType& key() const;
+
+  // Value for the current pair, iterator should be valid.
+  const ValueType& value() const;
+
+  // Move to the next pair, iterator should be valid.
+  void Next();
+
+ private:
+  friend struct Connection;
+
+  // Each cursor copies at most this many visible pairs at a time.
+  static constexpr size_t kBatchSize = 16;
+
+  // Scan position within one storage shard.
+  struct ShardCursor {
+    // Copied pairs which have not been consumed.
+    std::vector<std::pair<KeyType, ValueType>> pairs;
+    // Index for the current pair in [pairs].
+    size_t pos = 0;
+    // Whether there's no more key in range not copied yet.
+    bool exhausted = false;
+  };
+
+  ScanIterator(Database* db, Transaction* txn, KeyType begin, KeyType end);
+
+  // Copy the next batch of pairs for shard [shard_idx], return whether any
+  // pair is copied.
+  bool FillCursor(size_t shard_idx);
+
+  // Heap order, so the cursor with the smallest current key is at front.
+  bool CursorGreater(size_t lhs, size_t rhs) const;
+
+  Database* db_;
+  Transaction* txn_;
+  // Half-open key range [begin_, end_).
+  KeyType begin_;
+  KeyType end_;
+  // One cursor for each storage shard.
+  std::vector<ShardCursor> cursors_;
+  // Min-heap of shards whose cursor still has pairs.
+  std::vector<size_t> heap_;
+};
+
 // [Connection] represents a single [Transaction].
 struct Connection {
  public:
   Connection() = default;
+  Connection(const Connection&) = delete;
+  Connection& operator=(const Connection&) = delete;
+  // Moved-from connection doesn't own a transaction any more.
+  Connection(Connection&& rhs) noexcept;
+  Connection& operator=(Connection&& rhs) noexcept;
 
   // Abort transaction if not committed.
   ~Connection();
 
   // Get the value for [key], return `std::nullopt` if doesn't exist.
-  std::optional<ValueType> Get(const KeyType& key);
+  std::optional<ValueType> Get(std::string_view key);
+
+  // Same as [Get], but lends out the value without copy. The version it
+  // refers to is kept from garbage collection while current transaction is
+  // in progress, so the view stays valid until current transaction finishes
+  // or writes [key] again.
+  std::optional<std::string_view> GetView(std::string_view key);
 
-  // Set the given [key] and [value] pair to the database.
-  void Set(KeyType key, ValueType value);
+  // Get values for all [keys], each as if by [Get]. Keys are grouped by
+  // storage shard, so each shard is locked once for the whole batch.
+  std::vector<std::optional<ValueType>> MultiGet(
+      const std::vector<std::string_view>& keys);
 
-  // Delete the given [key], return whether deletion succeeds or not.
-  bool Delete(const KeyType& key);
+  // Set the given [key] and [value] pair to the database. Writes are not
+  // allowed for read-only connections. Return false if a write-write conflict
+  // is detected by an eager [WriteConflictPolicy], in which case current
+  // transaction can only abort.
+  bool Set(KeyType key, ValueType value);
+
+  // Delete the given [key], return whether deletion succeeds or not; it fails
+  // on write-write conflict as well, like [Set].
+  bool Delete(std::string_view key);
+
+  // Apply all writes in [batch], as if by [Set] and [Delete] in batch order.
+  // Writes are grouped by storage shard like [MultiGet], and missing keys in
+  // one shard are created with a single exclusive lock. Return false on
+  // write-write conflict like [Set].
+  bool Write(WriteBatch batch);
+
+  // Scan key-value pairs visible to current transaction within key range
+  // [begin, end), in ascending key order.
+  ScanIterator Scan(KeyType begin, KeyType end);
+
+  // Visit all key-value pairs visible to current transaction in unspecified
+  // order. Reads are not tracked for conflict detection, so it's meant for
+  // read-only consumers like checkpoint.
+  void ForEach(
+      const std::function<void(const KeyType&, const ValueType&)>& visitor);
 
   // Commit current transaction, whether commit succeeds or not.
   bool Commit();
 
+  // Same as [Commit], but instead of blocking until the transaction is
+  // durable, invoke [done] with whether it commits once it's decided and
+  // durable; [done] runs on the thread of durability policy, or inline if
+  // there's nothing to wait for. Validation only holds latches briefly, so
+  // event-loop threads could keep many transactions in flight; they should
+  // also use [WriteConflictPolicy::kNoWait], so writes never wait either.
+  // The connection could be destroyed before [done] runs.
+  void CommitAsync(std::function<void(bool)> done);
+
   // Abort current transaction.
   void Abort();
 
+  // Two-phase commit, for transactions spanning several databases, eg,
+  // partitions. Validate current transaction like [Commit], and return
+  // whether it could commit; otherwise it has aborted. Latches of written
+  // chains stay held until it finishes by [CommitPrepared] or [Abort], so the
+  // outcome cannot change, and it should finish soon.
+  bool Prepare();
+
+  // Make the prepared transaction visible and release its latches. Unlike
+  // [Commit], it neither waits for durability nor collects garbage, so it's
+  // cheap to call with caller's locks held; [FinishCommit] should follow.
+  void CommitPrepared();
+
+  // Block until the committed transaction is durable, if there's durability
+  // policy, and collect garbage if due.
+  void FinishCommit();
+
  private:
   friend class Database;
 
+  // Locks held by a validated transaction until it becomes visible.
+  struct CommitLocks {
+    std::vector<std::unique_lock<std::mutex>> chain_lcks;
+    std::shared_lock<std::shared_mutex> checkpoint_lck;
+    std::unique_lock<std::mutex> ssi_lck;
+  };
+
+  // Invoke [apply] with the latched chain for [key], along with its version
+  // pool and stored key, creating the chain if missing. Retry after waiting,
+  // if [apply] is blocked by an in-progress writer; return false on
+  // write-write conflict.
+  template <typename Apply>
+  bool WriteChain(KeyType key, const Apply& apply);
+
+  // Validate and finish current transaction with isolation [Policy], return
+  // whether it commits.
+  template <typename Policy>
+  bool TryCommit();
+
+  // Validate current transaction with isolation [Policy] and acquire [locks]
+  // for it; return whether it could commit, otherwise it should be rolled
+  // back by [Rollback] after releasing [locks].
+  template <typename Policy>
+  bool Validate(CommitLocks* locks);
+
+  // Abort current transaction, removing its versions from their chains
+  // eagerly, so readers never step over them, and dropping keys left empty.
+  void Rollback();
+
+  // Log and commit the validated transaction, with its locks held.
+  void Publish();
+
+  // Block until the committed transaction is durable, if there's durability
+  // policy.
+  void WaitDurable();
+
+  // Record stats and trace for transaction [txn] on [db], which committed
+  // and is durable, then collect garbage if due.
+  static void OnCommitted(Database* db, const Transaction& txn,
+                          std::chrono::steady_clock::time_point start_time);
+
   Database* db = nullptr;
   std::shared_ptr<Transaction> txn;
+  // Locks held by a prepared transaction.
+  std::unique_ptr<CommitLocks> prepared_locks;
 };
 
 // Definition for database.
 struct Database {
  public:
-  // Create a connection, which represents a transaction.
-  Connection CreateConn();
+  Database() = default;
+
+  Database(const Database&) = delete;
+  Database& operator=(const Database&) = delete;
 
+  // Destroy durability policy first, which might still invoke callbacks of
+  // asynchronous commits on the database.
+  ~Database() {
+    durability_policy.reset();
+  }
+
+  // Create a connection, which represents a transaction at the given
+  // [isolation_level]. Transactions at different levels could run on the
+  // same data, each gets the guarantees of its own level:
+  // - Snapshot isolation and serializable ones abort on write-write conflict
+  //   with any concurrent committed writer, whatever its level.
+  // - Serializable ones are only serializable among serializable ones, since
+  //   rw-antidependencies are only tracked between them.
+  //
+  // Once txn ids run beyond [kMaxTxnId], transactions could still read at
+  // snapshot isolation, but all their writes and commits fail, since the
+  // commit log cannot record them; the database has to be recreated, eg,
+  // from a checkpoint. Read-only ones from [CreateReadOnlyConn] take no txn
+  // id and keep working as usual.
+  Connection CreateConn(IsolationLevel isolation_level);
+  // Same as above, at the default isolation level.
+  Connection CreateConn() {
+    return CreateConn(isolation_level_);
+  }
+
+  // Create a connection for a read-only transaction, which never conflicts
+  // under snapshot isolation and weaker levels. It neither allocates txn id
+  // nor ends up in commit log, and takes snapshot without excluding other
+  // readers; only its snapshot xmin is published for GC. Serializable ones
+  // are tracked as usual, since they could still observe anomalies.
+  Connection CreateReadOnlyConn(IsolationLevel isolation_level);
+  // Same as above, at the default isolation level.
+  Connection CreateReadOnlyConn() {
+    return CreateReadOnlyConn(isolation_level_);
+  }
+
+  // Set the default isolation level, for connections created afterwards
+  // without one.
   void SetIsolationLevel(IsolationLevel level) {
     isolation_level_ = level;
   }
 
+  // Set when write-write conflicts are detected, [kAtCommit] by default.
+  void SetWriteConflictPolicy(WriteConflictPolicy policy) {
+    write_conflict_policy_ = policy;
+  }
+
+  // Persist committed transactions with the given [policy]; should be set
+  // before any connection is created.
+  void SetDurabilityPolicy(std::unique_ptr<DurabilityPolicy> policy) {
+    durability_policy = std::move(policy);
+  }
+
+  // Allocate txn ids from [oracle] instead of a local counter, [batch_size]
+  // ids at a time; should be set before any connection is created. Ids stay
+  // increasing within current database, but are not consecutive any more.
+  void SetTimestampOracle(std::shared_ptr<TimestampOracle> oracle,
+                          uint64_t batch_size = 1024) {
+    timestamp_oracle = std::move(oracle);
+    txn_id_batch_size = std::max<uint64_t>(batch_size, 1);
+  }
+
+  // Create a read-only connection, whose snapshot sees exactly the
+  // transactions logged by durability policy before the returned [lsn], which
+  // are already durable. [lsn] is 0 if there's no durability policy.
+  Connection CreateCheckpointConn(uint64_t* lsn);
+
+  // Keep versions for historical snapshots as of the latest [txn_num] txn
+  // ids, for [CreateConnAsOf]; 0 by default, which keeps no history beyond
+  // what in-progress transactions need. Extending retention doesn't bring
+  // back pruned history.
+  void SetHistoryRetention(uint64_t txn_num) {
+    history_retention_ = txn_num;
+  }
+
+  // Get the txn id for the next transaction, a snapshot as of which sees all
+  // transactions committed so far.
+  TxnId GetNextTxnId();
+
+  // Create a read-only connection at snapshot isolation, seeing what a
+  // transaction starting at [as_of] would have seen, ie, transactions which
+  // committed before [as_of] was handed out; [as_of] could be the next txn
+  // id, which is handed out right away. Return nullopt if [as_of] is in the
+  // future, or history as of it is no longer retained. The snapshot holds off
+  // GC like any other one.
+  std::optional<Connection> CreateConnAsOf(TxnId as_of);
+
+  // Run one garbage collection step every [txn_num] finished transactions,
+  // each step sweeps one storage shard; 0 disables incremental GC.
+  void SetGcInterval(uint64_t txn_num) {
+    gc_interval_ = txn_num;
+  }
+
+  // Run a full garbage collection pass over all storage shards.
+  void RunGc();
+
+  // Get the number of versions for all keys, mainly used for testing.
+  size_t GetVersionNum();
+
+  // Get statistics aggregated from all threads.
+  DatabaseStats GetStats();
+
+  // Set hook for trace events; should be set before any connection is
+  // created.
+  void SetTraceHook(TraceHook hook) {
+    trace_hook = std::move(hook);
+  }
+
  private:
   friend class Connection;
+  friend class ScanIterator;
+
+  // Statistics counters for one thread, which are only updated by their owner
+  // thread and read by aggregation. Aligned to avoid false sharing.
+  struct alignas(64) ThreadStats {
+    using Counter = std::atomic<uint64_t>;
+    using Histogram = std::array<Counter, DatabaseStats::kHistogramBucketNum>;
+
+    // Increment [counter] by [delta], cheaper than atomic read-modify-write
+    // since there's a single writer.
+    static void Add(Counter* counter, uint64_t delta = 1) {
+      counter->store(counter->load(std::memory_order_relaxed) + delta,
+                     std::memory_order_relaxed);
+    }
+
+    Counter begin_num{0};
+    Counter read_only_begin_num{0};
+    Counter commit_num{0};
+    Counter user_abort_num{0};
+    Counter write_conflict_abort_num{0};
+    Counter serialization_abort_num{0};
+    Counter read_num{0};
+    Counter scanned_version_num{0};
+    Histogram scanned_version_histogram{};
+    Histogram commit_latency_us_histogram{};
+  };
+
+  // Get statistics counters for the current thread.
+  ThreadStats* GetThreadStats();
 
   // Visibility check for read committed isolation level.
   bool IsVisibleForReadCommitted(const ValueWrapper& value_wrapper,
@@ -128,24 +907,257 @@ struct Database {
   // isolation.
   bool IsVisibleForRepeatableRead(const ValueWrapper& value_wrapper,
     Transaction* txn);
-  // Returns whether the given [value_wrapper] is visible for [txn].
+  // Returns whether the given [value_wrapper] is visible for [txn] with
+  // isolation [Policy].
+  template <typename Policy>
   bool IsVisible(const ValueWrapper& value_wrapper, Transaction* txn);
 
-  // Returns whether two transactions have write conflict.
-  bool HasWriteConflict(Transaction* txn1, Transaction* txn2);
+  // Take snapshot for a transaction which starts at [xmax]. [active_txns_mutex]
+  // should be held by caller.
+  Snapshot TakeSnapshot(TxnId xmax) const;
+
+  // Take snapshot as of [as_of], which has been handed out, as if it were
+  // taken right then. [active_txns_mutex] should be held by caller.
+  Snapshot TakeSnapshotAsOf(TxnId as_of) const;
+
+  // Allocate the next txn id, from timestamp oracle if any. [lck] should hold
+  // [active_txns_mutex] exclusively, which is released meanwhile if a new
+  // range is fetched from the oracle.
+  TxnId AllocateTxnId(std::unique_lock<std::shared_mutex>* lck);
+
+  // Publish read-only transaction [txn] in reader registry, return whether
+  // there's a free slot. [active_txns_mutex] should be held by caller.
+  bool RegisterReader(Transaction* txn);
+
+  // Returns the state for transaction [txn_id].
+  TransactionState GetTxnState(TxnId txn_id) const {
+    return commit_log.GetState(txn_id);
+  }
+
+  // Returns the state for start transaction of [value_wrapper], which is
+  // cached in hint bits once finished.
+  TransactionState GetStartTxnState(const ValueWrapper& value_wrapper) const;
+
+  // Update state for [txn], which is visible to all transactions afterwards.
+  void SetTxnState(Transaction* txn, TransactionState state);
+
+  // Update final state for [txn] and unregister it from active transactions.
+  void FinishTxn(Transaction* txn, TransactionState state);
 
-  // Returns whether two transactions have read-write conflict.
-  bool HasReadWriteConflict(Transaction* txn1, Transaction* txn2);
+  // Returns the newest version in [chain] visible to [txn] with isolation
+  // [Policy], or nullptr if none. [chain] should be latched by caller.
+  template <typename Policy>
+  const ValueWrapper* GetVisibleVersion(const VersionChain& chain,
+                                        Transaction* txn);
 
-  // Ongoing transactions.
-  // TODO(hjiang): Could prune committed transactions.
-  std::map<TxnId, std::shared_ptr<Transaction>> db_txns;
+  // Returns the version in [chain] visible to [txn] like [GetVisibleVersion],
+  // and tracks the read for serializable [txn]. [chain] should be latched by
+  // caller.
+  const ValueWrapper* ReadVersion(VersionChain* chain, Transaction* txn);
+  // Same as above, specialized for isolation [Policy] of [txn].
+  template <typename Policy>
+  const ValueWrapper* ReadVersion(VersionChain* chain, Transaction* txn);
+
+  // Write value or tombstone for [key] by [txn] onto [chain], allocating from
+  // [pool], and update write set; deletion only writes if there's a visible
+  // value, return whether it writes. [value] is only moved from if it writes.
+  // On eager write-write conflict, it doesn't write, and either marks [txn]
+  // with the conflict or the writer to wait for. [key] is owned by storage,
+  // and [chain] should be latched by caller.
+  bool WriteVersion(VersionChain* chain, VersionPool* pool, const KeyType* key,
+                    Transaction* txn, ValueType&& value, bool is_deleted);
+
+  // Returns a concurrent writer which has committed or is writing onto
+  // [chain] for [txn], or kInvalidTxnId if none. [chain] should be latched by
+  // caller.
+  TxnId FindConcurrentWriter(const VersionChain& chain, Transaction* txn);
+
+  // Wait for the writer which [txn] is blocked by to finish, return false if
+  // it's not blocked. No lock should be held by caller.
+  bool WaitForWriter(Transaction* txn);
+
+  // Install a new version allocated from [pool] and written by [txn] at the
+  // head of [chain], or overwrite the head if it's written by [txn] as well;
+  // return whether a new version is installed. [chain] should be latched by
+  // caller.
+  bool InstallVersion(VersionChain* chain, VersionPool* pool, Transaction* txn,
+                      ValueType&& value, bool is_deleted);
+
+  // Move the newest version written by committing transaction [txn_id] to
+  // the head of [chain], and drop its stale ones, so the newest committed
+  // version is always the latest committed one; return the moved version.
+  // [chain] should be latched by caller.
+  const ValueWrapper* MoveToCommitOrder(VersionChain* chain, TxnId txn_id);
+
+  // Get the oldest txn id which any in-progress transaction could refer to,
+  // aka, the minimum snapshot xmin; all transactions before it have finished.
+  TxnId GetLowWatermark();
+
+  // Get the oldest txn id whose snapshot versions should be kept for, given
+  // [low_watermark] and history retention.
+  TxnId GetHistoryWatermark(TxnId low_watermark);
+
+  // Track read on [chain] by serializable [txn], which sees [visible] version:
+  // place SIREAD marker, and record rw-antidependencies to writers of newer
+  // versions. [chain] should be latched by caller.
+  void TrackSerializableRead(VersionChain* chain, Transaction* txn,
+                             const ValueWrapper* visible);
+
+  // Track read on key range [begin, end) by serializable [txn], to detect
+  // phantoms, aka, keys inserted into the range by concurrent writers. It
+  // should be invoked before looking up keys in storage shards.
+  void TrackSerializableRangeRead(Transaction* txn, KeyType begin,
+                                  KeyType end);
+
+  // Track write on [chain] by serializable [txn], record rw-antidependencies
+  // from concurrent readers. [chain] should be latched by caller.
+  void TrackSerializableWrite(VersionChain* chain, Transaction* txn);
+
+  // Track insertion of [key] by serializable [txn], which creates its chain,
+  // record rw-antidependencies from concurrent readers whose read ranges
+  // cover [key]. The storage shard for [key] should be exclusively locked by
+  // caller.
+  void TrackSerializableInsert(const KeyType& key, Transaction* txn);
+
+  // Record rw-antidependency from [reader] to [writer], and doom the one in
+  // progress if the other one is a committed pivot. [ssi_mutex] should be held
+  // by caller.
+  void AddRwConflict(Transaction* reader, Transaction* writer);
+
+  // Remove versions in [chain] written by aborted transactions, or shadowed
+  // for all snapshots no older than [history_watermark], as well as SIREAD
+  // markers no transaction concurrent with [low_watermark] cares. [chain]
+  // should be latched by caller.
+  void PruneVersions(VersionChain* chain, TxnId low_watermark,
+                     TxnId history_watermark);
+
+  // Invoked after a transaction commits or aborts, which runs a GC step if
+  // necessary.
+  void OnTxnFinished();
+
+  // Sweep the next storage shard, and drop serializable transactions no
+  // longer involved in conflicts. [gc_mutex] should be held by caller.
+  void RunGcStep();
+
+  // Number of lock stripes for [storage].
+  static constexpr size_t kStorageShardNum = 64;
+
+  // A lock stripe of the storage; [mutex] only guards the key-to-chain
+  // mapping, which is ordered for range scan; versions are guarded by their
+  // chain latch.
+  //
+  // Lock order: shard mutex, then chain latch; multiple shards are locked in
+  // index order, and multiple chains are latched in address order.
+  struct StorageShard {
+    std::shared_mutex mutex;
+    // Versions for chains in the shard, which outlives [chains].
+    VersionPool pool;
+    // Transparent comparator allows lookup by `std::string_view`.
+    std::map<KeyType, std::unique_ptr<VersionChain>, std::less<>> chains;
+  };
+
+  // Get the storage shard which [key] belongs to.
+  static size_t GetShardIndex(std::string_view key);
+  StorageShard& GetShard(std::string_view key);
+
+  // Erase chains for [keys] from [shard], which are left with no version and
+  // no SIREAD marker.
+  void EraseEmptyChains(StorageShard* shard, const std::vector<KeyType>& keys);
+
+  // Intern absent [key] into [shard] as an empty chain, so reads by
+  // serializable transactions are tracked by SIREAD markers on the chain
+  // like any other key, instead of key ranges every insertion is compared
+  // against. GC drops the chain once it's left with no marker.
+  void InternKey(StorageShard* shard, std::string_view key);
+
+  // Get the chain for [key] in [shard], create it if not exists; return the
+  // chain along with its key owned by storage. [shard] should be exclusively
+  // locked by caller.
+  std::pair<VersionChain*, const KeyType*> CreateChain(StorageShard* shard,
+                                                       KeyType key);
+
+  // Guards [active_txns], [late_committers] and txn id allocation, which
+  // require exclusive access; read-only transactions take snapshot in shared
+  // mode.
+  std::shared_mutex active_txns_mutex;
+  // Maps from in-progress txn id to its snapshot xmin.
+  std::map<TxnId, TxnId> active_txns;
+  // Writers which committed after later txn ids were handed out, along with
+  // the next txn id when they committed, in commit order; historical
+  // snapshots as of those later ids take them as in progress.
+  std::deque<std::pair<TxnId, TxnId>> late_committers;
+  // Number of slots in reader registry.
+  static constexpr size_t kReaderSlotNum = 256;
+  // Snapshot xmin for in-progress read-only transactions, which are not in
+  // [active_txns]; kInvalidTxnId for free slots. Slots are claimed with
+  // [active_txns_mutex] held in shared mode, so the low watermark computed
+  // with the mutex held never passes the claimer's snapshot.
+  std::array<std::atomic<TxnId>, kReaderSlotNum> reader_slots{};
+  // States for all transactions.
+  CommitLog commit_log;
+  // Optional policy to persist committed transactions.
+  std::unique_ptr<DurabilityPolicy> durability_policy;
+  // Logging and becoming visible happen atomically for committers holding it
+  // in shared mode, so a checkpoint could cut the log at a snapshot.
+  std::shared_mutex checkpoint_mutex;
+  // Guards serializable transactions and their SSI states.
+  std::mutex ssi_mutex;
+  // Serializable transactions which could still be involved in
+  // rw-antidependencies; finished ones before low watermark are dropped by GC.
+  std::unordered_map<TxnId, std::shared_ptr<Transaction>> ssi_txns;
   // Multi-version in-memory storage.
-  std::unordered_map<KeyType, std::vector<ValueWrapper>> storage;
-  // Next transaction id.
-  TxnId next_txn_id = kInvalidTxnId + 1;
-  // Isolation level.
-  IsolationLevel isolation_level_ = IsolationLevel::kSnapshotIsolation;
+  std::array<StorageShard, kStorageShardNum> storage;
+  // Next transaction id, which is only advanced with [active_txns_mutex]
+  // exclusively held.
+  std::atomic<TxnId> next_txn_id{kInvalidTxnId + 1};
+  // Optional oracle to allocate txn ids from, and the end of the range
+  // allocated from it, guarded by [active_txns_mutex]; the range is only
+  // updated with [oracle_mutex] held as well.
+  std::shared_ptr<TimestampOracle> timestamp_oracle;
+  uint64_t txn_id_batch_size = 0;
+  TxnId txn_id_range_end = kInvalidTxnId;
+  // Serializes fetches from [timestamp_oracle], which happen with
+  // [active_txns_mutex] released; acquired before [active_txns_mutex].
+  std::mutex oracle_mutex;
+  // Default isolation level.
+  std::atomic<IsolationLevel> isolation_level_{
+      IsolationLevel::kSnapshotIsolation};
+  // When write-write conflicts are detected.
+  std::atomic<WriteConflictPolicy> write_conflict_policy_{
+      WriteConflictPolicy::kAtCommit};
+
+  // Number of finished transactions between two GC steps.
+  std::atomic<uint64_t> gc_interval_{64};
+  // Number of latest txn ids to keep history for.
+  std::atomic<uint64_t> history_retention_{0};
+  // Number of finished transactions.
+  std::atomic<uint64_t> finished_txn_num_{0};
+  // Guards GC state below, only one GC step runs at a time.
+  std::mutex gc_mutex;
+  // Next storage shard to sweep.
+  size_t gc_next_shard = 0;
+  // Low watermark observed by the latest GC step, which is used to prune
+  // versions on write path; a stale one is always safe.
+  std::atomic<TxnId> gc_low_watermark{kInvalidTxnId};
+  // History watermark used by the latest GC step, which never decreases;
+  // versions for historical snapshots before it might have been pruned.
+  std::atomic<TxnId> gc_history_watermark{kInvalidTxnId};
+  // Version chain lengths observed by the latest sweep of each shard.
+  std::array<DatabaseStats::Histogram, kStorageShardNum>
+      gc_chain_length_histograms{};
+
+  // Unique id among all databases, to look up thread-local statistics.
+  const uint64_t stats_id = GetNextStatsId();
+  // Returns the next unique database id.
+  static uint64_t GetNextStatsId();
+  // Guards [thread_stats].
+  std::mutex stats_mutex;
+  // Statistics counters for each thread which has used the database; they're
+  // kept after the thread exits, and reused by a thread with the same id.
+  std::map<std::thread::id, std::unique_ptr<ThreadStats>> thread_stats;
+
+  // Optional hook for trace events.
+  TraceHook trace_hook;
 };
 
 }  // namespace mvcc
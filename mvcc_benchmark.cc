@@ -0,0 +1,374 @@
+// YCSB-style concurrent benchmark for the MVCC engine.
+//
+// Each operation runs as one transaction, aborted ones are counted but not
+// retried. Workloads follow YCSB core workloads:
+//   a: 50% read, 50% update
+//   b: 95% read, 5% update
+//   c: 100% read
+//   d: 95% read latest, 5% insert
+//   e: 95% short scan, 5% insert
+//   f: 50% read, 50% read-modify-write
+//
+// Usage:
+//   mvcc_benchmark --workload=a --key_num=100000 --value_size=100
+//       --zipf_theta=0.99 --threads=8 --duration_sec=10 --isolation=si
+//       --conflict=commit
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mvcc.h"
+
+namespace mvcc {
+
+namespace {
+
+struct BenchmarkOptions {
+  char workload = 'a';
+  uint64_t key_num = 100000;
+  size_t value_size = 100;
+  // 0 means uniform distribution.
+  double zipf_theta = 0.99;
+  int thread_num = 8;
+  int duration_sec = 10;
+  IsolationLevel isolation_level = IsolationLevel::kSnapshotIsolation;
+  WriteConflictPolicy write_conflict_policy = WriteConflictPolicy::kAtCommit;
+  // Maximum number of records for one scan.
+  int max_scan_len = 100;
+};
+
+// Parse [arg] in `--name=value` format, return whether [name] matches.
+bool ParseFlag(const char* arg, const char* name, std::string* value) {
+  const size_t name_len = std::strlen(name);
+  if (std::strncmp(arg, "--", 2) != 0
+      || std::strncmp(arg + 2, name, name_len) != 0
+      || arg[2 + name_len] != '=') {
+    return false;
+  }
+  *value = arg + 3 + name_len;
+  return true;
+}
+
+[[noreturn]] void ExitWithUsage(const char* arg) {
+  std::fprintf(stderr,
+               "Invalid argument: %s\n"
+               "Flags: --workload=[a-f] --key_num=N --value_size=N "
+               "--zipf_theta=F --threads=N --duration_sec=N "
+               "--isolation=[rc|rr|si|ser] --max_scan_len=N "
+               "--conflict=[commit|no_wait|wait_die]\n",
+               arg);
+  std::exit(1);
+}
+
+BenchmarkOptions ParseOptions(int argc, char** argv) {
+  BenchmarkOptions options;
+  for (int idx = 1; idx < argc; ++idx) {
+    const char* arg = argv[idx];
+    std::string value;
+    if (ParseFlag(arg, "workload", &value)) {
+      if (value.size() != 1 || value[0] < 'a' || value[0] > 'f') {
+        ExitWithUsage(arg);
+      }
+      options.workload = value[0];
+    } else if (ParseFlag(arg, "key_num", &value)) {
+      options.key_num = std::stoull(value);
+    } else if (ParseFlag(arg, "value_size", &value)) {
+      options.value_size = std::stoull(value);
+    } else if (ParseFlag(arg, "zipf_theta", &value)) {
+      options.zipf_theta = std::stod(value);
+    } else if (ParseFlag(arg, "threads", &value)) {
+      options.thread_num = std::stoi(value);
+    } else if (ParseFlag(arg, "duration_sec", &value)) {
+      options.duration_sec = std::stoi(value);
+    } else if (ParseFlag(arg, "max_scan_len", &value)) {
+      options.max_scan_len = std::stoi(value);
+    } else if (ParseFlag(arg, "isolation", &value)) {
+      if (value == "rc") {
+        options.isolation_level = IsolationLevel::kReadCommittedIsolation;
+      } else if (value == "rr") {
+        options.isolation_level = IsolationLevel::kRepeatableReadIsolation;
+      } else if (value == "si") {
+        options.isolation_level = IsolationLevel::kSnapshotIsolation;
+      } else if (value == "ser") {
+        options.isolation_level = IsolationLevel::kSerializableIsolation;
+      } else {
+        ExitWithUsage(arg);
+      }
+    } else if (ParseFlag(arg, "conflict", &value)) {
+      if (value == "commit") {
+        options.write_conflict_policy = WriteConflictPolicy::kAtCommit;
+      } else if (value == "no_wait") {
+        options.write_conflict_policy = WriteConflictPolicy::kNoWait;
+      } else if (value == "wait_die") {
+        options.write_conflict_policy = WriteConflictPolicy::kWaitDie;
+      } else {
+        ExitWithUsage(arg);
+      }
+    } else {
+      ExitWithUsage(arg);
+    }
+  }
+  if (options.key_num == 0 || options.thread_num <= 0
+      || options.zipf_theta < 0 || options.zipf_theta >= 1
+      || options.max_scan_len <= 0) {
+    ExitWithUsage("out-of-range value");
+  }
+  return options;
+}
+
+// Zipfian distribution over ranks [0, item_num), where rank 0 is the most
+// popular one; see "Quickly Generating Billion-Record Synthetic Databases".
+class ZipfianGenerator {
+ public:
+  ZipfianGenerator(uint64_t item_num, double theta)
+      : item_num_(item_num), theta_(theta) {
+    zetan_ = Zeta(item_num, theta);
+    const double zeta2 = Zeta(2, theta);
+    alpha_ = 1.0 / (1.0 - theta);
+    eta_ = (1.0 - std::pow(2.0 / item_num, 1.0 - theta))
+        / (1.0 - zeta2 / zetan_);
+  }
+
+  template <typename Rng>
+  uint64_t Next(Rng* rng) const {
+    const double u = std::uniform_real_distribution<double>(0, 1)(*rng);
+    const double uz = u * zetan_;
+    if (uz < 1.0) {
+      return 0;
+    }
+    if (uz < 1.0 + std::pow(0.5, theta_)) {
+      return std::min<uint64_t>(1, item_num_ - 1);
+    }
+    const auto rank = static_cast<uint64_t>(
+        item_num_ * std::pow(eta_ * u - eta_ + 1.0, alpha_));
+    return std::min(rank, item_num_ - 1);
+  }
+
+ private:
+  static double Zeta(uint64_t item_num, double theta) {
+    double sum = 0;
+    for (uint64_t idx = 1; idx <= item_num; ++idx) {
+      sum += 1.0 / std::pow(static_cast<double>(idx), theta);
+    }
+    return sum;
+  }
+
+  uint64_t item_num_;
+  double theta_;
+  double zetan_;
+  double alpha_;
+  double eta_;
+};
+
+// Spread popular ranks over the whole key space, like YCSB scrambled zipfian.
+uint64_t ScrambleRank(uint64_t rank, uint64_t key_num) {
+  // FNV-1a over the rank bytes.
+  uint64_t hash = 0xCBF29CE484222325ull;
+  for (int idx = 0; idx < 8; ++idx) {
+    hash ^= (rank >> (idx * 8)) & 0xFF;
+    hash *= 0x100000001B3ull;
+  }
+  return hash % key_num;
+}
+
+// Fixed width keys, so key order is the same as number order.
+KeyType MakeKey(uint64_t key_idx) {
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "user%012llu",
+                static_cast<unsigned long long>(key_idx));
+  return buf;
+}
+
+// Per-thread results.
+struct ThreadStats {
+  uint64_t commit_num = 0;
+  uint64_t abort_num = 0;
+  // Latency for each transaction, in nanoseconds.
+  std::vector<uint64_t> latencies_ns;
+};
+
+class Benchmark {
+ public:
+  explicit Benchmark(const BenchmarkOptions& options)
+      : options_(options),
+        zipfian_(options.key_num, options.zipf_theta),
+        inserted_key_num_(options.key_num) {
+    db_.SetIsolationLevel(options.isolation_level);
+    db_.SetWriteConflictPolicy(options.write_conflict_policy);
+  }
+
+  void Load() {
+    constexpr uint64_t kBatchSize = 1000;
+    const ValueType value(options_.value_size, 'v');
+    for (uint64_t begin = 0; begin < options_.key_num; begin += kBatchSize) {
+      auto conn = db_.CreateConn();
+      WriteBatch batch;
+      const uint64_t end = std::min(begin + kBatchSize, options_.key_num);
+      for (uint64_t key_idx = begin; key_idx < end; ++key_idx) {
+        batch.Set(MakeKey(key_idx), value);
+      }
+      conn.Write(std::move(batch));
+      if (!conn.Commit()) {
+        std::fprintf(stderr, "Failed to load records\n");
+        std::exit(1);
+      }
+    }
+  }
+
+  void Run() {
+    std::vector<ThreadStats> stats(options_.thread_num);
+    std::atomic<bool> stopped{false};
+    std::vector<std::thread> threads;
+    threads.reserve(options_.thread_num);
+    const auto start = std::chrono::steady_clock::now();
+    for (int thd_idx = 0; thd_idx < options_.thread_num; ++thd_idx) {
+      threads.emplace_back([this, &stats, &stopped, thd_idx]() {
+        RunThread(thd_idx, &stopped, &stats[thd_idx]);
+      });
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(options_.duration_sec));
+    stopped = true;
+    for (auto& cur_thread : threads) {
+      cur_thread.join();
+    }
+    const double elapsed_sec = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    Report(stats, elapsed_sec);
+  }
+
+ private:
+  // Pick an existing key following the request distribution.
+  template <typename Rng>
+  uint64_t NextKeyIdx(Rng* rng) const {
+    const uint64_t rank = zipfian_.Next(rng);
+    if (options_.workload == 'd') {
+      // Latest distribution, the most recently inserted keys are popular.
+      const uint64_t key_num = inserted_key_num_.load();
+      return key_num - 1 - std::min(rank, key_num - 1);
+    }
+    return ScrambleRank(rank, options_.key_num);
+  }
+
+  void RunThread(int thd_idx, const std::atomic<bool>* stopped,
+                 ThreadStats* stats) {
+    std::mt19937_64 rng(thd_idx + 1);
+    std::uniform_int_distribution<int> percent_dist(0, 99);
+    std::uniform_int_distribution<int> scan_len_dist(1, options_.max_scan_len);
+    const ValueType value(options_.value_size, 'u');
+
+    // Percentage of the first operation type for each workload.
+    int read_percent = 0;
+    switch (options_.workload) {
+      case 'a': read_percent = 50; break;
+      case 'b': read_percent = 95; break;
+      case 'c': read_percent = 100; break;
+      case 'd': read_percent = 95; break;
+      case 'e': read_percent = 95; break;
+      case 'f': read_percent = 50; break;
+    }
+
+    while (!*stopped) {
+      const bool is_read = percent_dist(rng) < read_percent;
+      const auto start = std::chrono::steady_clock::now();
+      bool committed = true;
+      if (is_read && options_.workload == 'e') {
+        // Keys are dense, so a key range approximates a record count.
+        auto conn = db_.CreateReadOnlyConn();
+        const uint64_t begin_idx = NextKeyIdx(&rng);
+        for (auto iter = conn.Scan(MakeKey(begin_idx),
+                                   MakeKey(begin_idx + scan_len_dist(rng)));
+             iter.Valid(); iter.Next()) {
+        }
+        committed = conn.Commit();
+      } else if (is_read) {
+        auto conn = db_.CreateReadOnlyConn();
+        conn.GetView(MakeKey(NextKeyIdx(&rng)));
+        committed = conn.Commit();
+      } else if (options_.workload == 'd' || options_.workload == 'e') {
+        auto conn = db_.CreateConn();
+        conn.Set(MakeKey(inserted_key_num_++), value);
+        committed = conn.Commit();
+      } else if (options_.workload == 'f') {
+        auto conn = db_.CreateConn();
+        const auto key = MakeKey(NextKeyIdx(&rng));
+        const auto old_value = conn.Get(key);
+        conn.Set(key, old_value.has_value() ? *old_value : value);
+        committed = conn.Commit();
+      } else {
+        auto conn = db_.CreateConn();
+        conn.Set(MakeKey(NextKeyIdx(&rng)), value);
+        committed = conn.Commit();
+      }
+      const auto latency = std::chrono::steady_clock::now() - start;
+      stats->latencies_ns.emplace_back(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(latency)
+              .count());
+      ++(committed ? stats->commit_num : stats->abort_num);
+    }
+  }
+
+  void Report(const std::vector<ThreadStats>& stats, double elapsed_sec) {
+    uint64_t commit_num = 0;
+    uint64_t abort_num = 0;
+    std::vector<uint64_t> latencies_ns;
+    for (const auto& cur_stats : stats) {
+      commit_num += cur_stats.commit_num;
+      abort_num += cur_stats.abort_num;
+      latencies_ns.insert(latencies_ns.end(), cur_stats.latencies_ns.begin(),
+                          cur_stats.latencies_ns.end());
+    }
+    std::sort(latencies_ns.begin(), latencies_ns.end());
+    const auto percentile_us = [&latencies_ns](double percentile) {
+      if (latencies_ns.empty()) {
+        return 0.0;
+      }
+      const auto idx = static_cast<size_t>(percentile * latencies_ns.size());
+      return latencies_ns[std::min(idx, latencies_ns.size() - 1)] / 1000.0;
+    };
+
+    const uint64_t txn_num = commit_num + abort_num;
+    std::printf("workload=%c key_num=%llu value_size=%zu zipf_theta=%.2f "
+                "threads=%d isolation_level=%d write_conflict_policy=%d\n",
+                options_.workload,
+                static_cast<unsigned long long>(options_.key_num),
+                options_.value_size, options_.zipf_theta, options_.thread_num,
+                static_cast<int>(options_.isolation_level),
+                static_cast<int>(options_.write_conflict_policy));
+    std::printf("throughput: %.0f txn/s, commits: %llu, aborts: %llu, "
+                "abort rate: %.3f%%\n",
+                txn_num / elapsed_sec,
+                static_cast<unsigned long long>(commit_num),
+                static_cast<unsigned long long>(abort_num),
+                txn_num == 0 ? 0.0 : 100.0 * abort_num / txn_num);
+    std::printf("latency: p50 %.2f us, p99 %.2f us, p999 %.2f us\n",
+                percentile_us(0.5), percentile_us(0.99), percentile_us(0.999));
+  }
+
+  const BenchmarkOptions options_;
+  const ZipfianGenerator zipfian_;
+  Database db_;
+  // Number of keys, including ones inserted during benchmark.
+  std::atomic<uint64_t> inserted_key_num_;
+};
+
+}  // namespace
+
+}  // namespace mvcc
+
+int main(int argc, char** argv) {
+  const auto options = mvcc::ParseOptions(argc, argv);
+  mvcc::Benchmark benchmark(options);
+  benchmark.Load();
+  benchmark.Run();
+  return 0;
+}
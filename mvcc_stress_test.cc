@@ -0,0 +1,506 @@
+// Stress tests under contention, which record concurrent histories and check
+// them for anomalies forbidden at each isolation level.
+//
+// Every transaction writes its own unique label as value, so each value read
+// identifies its writer. Read-write transactions always read a key before
+// writing it, so under snapshot isolation and serializable isolation, where
+// no update is lost, the version order of each key is recovered from the
+// values read before writes. Checks follow Adya's phenomena:
+//   read committed:  G1a (aborted reads), G1b (intermediate reads)
+//   repeatable read: plus fuzzy reads
+//   snapshot:        plus lost updates, G1c and G-single cycles
+//   serializable:    plus any dependency cycle (G2)
+
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "test_utils.h"
+
+namespace mvcc {
+
+namespace {
+
+constexpr size_t kKeyNum = 16;
+// Keys picked by half of all operations.
+constexpr size_t kHotKeyNum = 2;
+// Label of the transaction which loads all keys.
+constexpr char kInitLabel[] = "init";
+// Suffix for values overwritten within the same transaction.
+constexpr char kIntermediateSuffix = '~';
+
+// Fixed width keys, so key order is the same as index order.
+KeyType MakeKey(size_t key_idx) {
+  char buf[16];
+  std::snprintf(buf, sizeof(buf), "key-%02zu", key_idx);
+  return buf;
+}
+
+size_t GetKeyIndex(const KeyType& key) {
+  return std::stoul(key.substr(4));
+}
+
+// Operations of one transaction within a history.
+struct TxnRecord {
+  // Unique label for the transaction, also the value for all its writes.
+  std::string label;
+  bool committed = false;
+  // Reads of values not written by the transaction itself, in order.
+  std::vector<std::pair<size_t, std::string>> reads;
+  // Written keys, each with the value read right before writing it.
+  std::vector<std::pair<size_t, std::string>> writes;
+};
+
+// Sort [graph] topologically, and get the position of each node in [pos].
+// Return false if there's a cycle.
+bool SortTopologically(const std::vector<std::vector<size_t>>& graph,
+                       std::vector<size_t>* pos) {
+  std::vector<size_t> in_degrees(graph.size());
+  for (const auto& edges : graph) {
+    for (const size_t dst : edges) {
+      ++in_degrees[dst];
+    }
+  }
+  std::vector<size_t> ready;
+  for (size_t node = 0; node < graph.size(); ++node) {
+    if (in_degrees[node] == 0) {
+      ready.emplace_back(node);
+    }
+  }
+  pos->assign(graph.size(), 0);
+  size_t sorted_num = 0;
+  while (!ready.empty()) {
+    const size_t node = ready.back();
+    ready.pop_back();
+    (*pos)[node] = sorted_num++;
+    for (const size_t dst : graph[node]) {
+      if (--in_degrees[dst] == 0) {
+        ready.emplace_back(dst);
+      }
+    }
+  }
+  return sorted_num == graph.size();
+}
+
+// Check [txns] executed at [isolation_level], where the first one loads all
+// keys, and [final_values] are read after all others finish. Return the
+// first anomaly found, or empty string if none.
+std::string CheckHistory(IsolationLevel isolation_level,
+                         const std::vector<TxnRecord>& txns,
+                         const std::vector<std::string>& final_values) {
+  std::unordered_map<std::string, size_t> writers;
+  for (size_t idx = 0; idx < txns.size(); ++idx) {
+    writers.emplace(txns[idx].label, idx);
+  }
+  const auto describe = [](const TxnRecord& txn, size_t key_idx,
+                           const std::string& value) {
+    return txn.label + " reads " + value + " on " + MakeKey(key_idx);
+  };
+
+  // Every value read was written by a committed transaction, as its final
+  // value of the key.
+  for (const auto& txn : txns) {
+    if (!txn.committed) {
+      continue;
+    }
+    for (const auto& [key_idx, value] : txn.reads) {
+      if (!value.empty() && value.back() == kIntermediateSuffix) {
+        return "G1b: " + describe(txn, key_idx, value);
+      }
+      const auto iter = writers.find(value);
+      if (iter == writers.end()) {
+        return "Unknown value: " + describe(txn, key_idx, value);
+      }
+      if (!txns[iter->second].committed) {
+        return "G1a: " + describe(txn, key_idx, value);
+      }
+    }
+  }
+  if (isolation_level == IsolationLevel::kReadCommittedIsolation) {
+    return "";
+  }
+
+  // Reads of the same key within a transaction never change.
+  for (const auto& txn : txns) {
+    if (!txn.committed) {
+      continue;
+    }
+    std::map<size_t, std::string> first_reads;
+    for (const auto& [key_idx, value] : txn.reads) {
+      const auto [iter, inserted] = first_reads.emplace(key_idx, value);
+      if (!inserted && iter->second != value) {
+        return "Fuzzy read: " + describe(txn, key_idx, iter->second)
+            + " then " + value;
+      }
+    }
+  }
+  if (isolation_level == IsolationLevel::kRepeatableReadIsolation) {
+    return "";
+  }
+
+  // Each version is overwritten by at most one committed transaction, so
+  // versions of each key form a chain starting from the initial load.
+  std::map<std::pair<size_t, size_t>, size_t> next_writers;
+  for (size_t idx = 0; idx < txns.size(); ++idx) {
+    if (!txns[idx].committed) {
+      continue;
+    }
+    for (const auto& [key_idx, prev_value] : txns[idx].writes) {
+      const auto [iter, inserted] = next_writers.emplace(
+          std::make_pair(key_idx, writers.at(prev_value)), idx);
+      if (!inserted) {
+        return "Lost update: " + txns[iter->second].label + " and "
+            + txns[idx].label + " both overwrite " + prev_value + " on "
+            + MakeKey(key_idx);
+      }
+    }
+  }
+  for (size_t key_idx = 0; key_idx < final_values.size(); ++key_idx) {
+    const size_t writer = writers.at(final_values[key_idx]);
+    if (next_writers.count({key_idx, writer}) > 0) {
+      return "Stale final value: " + final_values[key_idx] + " on "
+          + MakeKey(key_idx);
+    }
+  }
+
+  // Write and read dependencies, and anti-dependencies from readers to the
+  // writers of next versions.
+  std::vector<std::vector<size_t>> deps(txns.size());
+  std::vector<std::pair<size_t, size_t>> anti_deps;
+  for (size_t idx = 0; idx < txns.size(); ++idx) {
+    if (!txns[idx].committed) {
+      continue;
+    }
+    for (const auto& [key_idx, prev_value] : txns[idx].writes) {
+      deps[writers.at(prev_value)].emplace_back(idx);
+    }
+    for (const auto& [key_idx, value] : txns[idx].reads) {
+      const size_t writer = writers.at(value);
+      if (writer != idx) {
+        deps[writer].emplace_back(idx);
+      }
+      const auto iter = next_writers.find({key_idx, writer});
+      if (iter != next_writers.end() && iter->second != idx) {
+        anti_deps.emplace_back(idx, iter->second);
+      }
+    }
+  }
+
+  std::vector<size_t> pos;
+  if (!SortTopologically(deps, &pos)) {
+    return "G1c: cycle of write and read dependencies";
+  }
+  // A cycle with a single anti-dependency means the reader depends on the
+  // writer which overwrites what it reads. Nodes after the reader in
+  // topological order never reach it.
+  std::vector<size_t> visited(txns.size(), 0);
+  size_t visit_round = 0;
+  for (const auto& [reader, writer] : anti_deps) {
+    ++visit_round;
+    std::vector<size_t> stack{writer};
+    visited[writer] = visit_round;
+    while (!stack.empty()) {
+      const size_t node = stack.back();
+      stack.pop_back();
+      if (node == reader) {
+        return "G-single: " + txns[reader].label + " misses "
+            + txns[writer].label + " it depends on";
+      }
+      for (const size_t dst : deps[node]) {
+        if (visited[dst] != visit_round && pos[dst] <= pos[reader]) {
+          visited[dst] = visit_round;
+          stack.emplace_back(dst);
+        }
+      }
+    }
+  }
+  if (isolation_level == IsolationLevel::kSnapshotIsolation) {
+    return "";
+  }
+
+  for (const auto& [reader, writer] : anti_deps) {
+    deps[reader].emplace_back(writer);
+  }
+  if (!SortTopologically(deps, &pos)) {
+    return "G2: cycle with anti-dependencies";
+  }
+  return "";
+}
+
+// Pick a key, where hot keys take half of all operations.
+size_t PickKey(std::mt19937* rng) {
+  if (std::uniform_int_distribution<int>(0, 1)(*rng) == 0) {
+    return std::uniform_int_distribution<size_t>(0, kHotKeyNum - 1)(*rng);
+  }
+  return std::uniform_int_distribution<size_t>(0, kKeyNum - 1)(*rng);
+}
+
+// Read [key_idx] after current transaction writes [own_value] to it into
+// [txn]. Concurrent writers never commit on top of its own version and get
+// read, except under read committed, where the latest committed version wins.
+void ReadOwnWrite(Connection* conn, IsolationLevel isolation_level,
+                  size_t key_idx, const std::string& own_value,
+                  TxnRecord* txn) {
+  const auto value = conn->Get(MakeKey(key_idx));
+  EXPECT_TRUE(value.has_value());
+  if (*value != own_value) {
+    EXPECT_TRUE(isolation_level == IsolationLevel::kReadCommittedIsolation);
+    txn->reads.emplace_back(key_idx, *value);
+  }
+}
+
+// Run a short transaction of reads and read-modify-writes on skewed keys.
+TxnRecord RunReadWriteTxn(Database* db, IsolationLevel isolation_level,
+                          std::string label, std::mt19937* rng) {
+  TxnRecord txn;
+  txn.label = std::move(label);
+  auto conn = db->CreateConn();
+  std::map<size_t, bool> written;
+  const int op_num = std::uniform_int_distribution<int>(1, 4)(*rng);
+  for (int op_idx = 0; op_idx < op_num; ++op_idx) {
+    const size_t key_idx = PickKey(rng);
+    if (written[key_idx]) {
+      ReadOwnWrite(&conn, isolation_level, key_idx, txn.label, &txn);
+      continue;
+    }
+    const auto key = MakeKey(key_idx);
+    const auto value = conn.Get(key);
+    EXPECT_TRUE(value.has_value());
+    txn.reads.emplace_back(key_idx, *value);
+    std::this_thread::yield();
+    if (std::uniform_int_distribution<int>(0, 1)(*rng) == 0) {
+      continue;
+    }
+    // Overwrite the key twice, only the final value should ever be read by
+    // others.
+    const auto intermediate_value = txn.label + kIntermediateSuffix;
+    if (!conn.Set(key, intermediate_value)) {
+      conn.Abort();
+      return txn;
+    }
+    ReadOwnWrite(&conn, isolation_level, key_idx, intermediate_value, &txn);
+    if (!conn.Set(key, txn.label)) {
+      conn.Abort();
+      return txn;
+    }
+    written[key_idx] = true;
+    txn.writes.emplace_back(key_idx, *value);
+    std::this_thread::yield();
+  }
+  txn.committed = conn.Commit();
+  return txn;
+}
+
+// Run a long transaction, which reads all keys one by one, then once more by
+// a scan, yielding between reads to let writers interleave.
+TxnRecord RunLongReadTxn(Database* db, std::string label, bool read_only) {
+  TxnRecord txn;
+  txn.label = std::move(label);
+  auto conn = read_only ? db->CreateReadOnlyConn() : db->CreateConn();
+  for (size_t key_idx = 0; key_idx < kKeyNum; ++key_idx) {
+    const auto value = conn.Get(MakeKey(key_idx));
+    EXPECT_TRUE(value.has_value());
+    txn.reads.emplace_back(key_idx, *value);
+    std::this_thread::yield();
+  }
+  size_t scanned_num = 0;
+  for (auto iter = conn.Scan(MakeKey(0), MakeKey(kKeyNum)); iter.Valid();
+       iter.Next()) {
+    EXPECT_EQ(iter.key(), MakeKey(scanned_num));
+    txn.reads.emplace_back(GetKeyIndex(iter.key()), iter.value());
+    ++scanned_num;
+    std::this_thread::yield();
+  }
+  EXPECT_EQ(scanned_num, kKeyNum);
+  txn.committed = conn.Commit();
+  return txn;
+}
+
+}  // namespace
+
+// Testing senario: read-write transactions on hot keys run next to
+// long-running readers, the recorded history has no anomaly forbidden at
+// [isolation_level], and statistics account for every transaction.
+void TestHistory(IsolationLevel isolation_level,
+                 WriteConflictPolicy write_conflict_policy) {
+  Database db{};
+  db.SetIsolationLevel(isolation_level);
+  db.SetWriteConflictPolicy(write_conflict_policy);
+
+  std::vector<TxnRecord> txns(1);
+  txns[0].label = kInitLabel;
+  {
+    auto conn = db.CreateConn();
+    for (size_t key_idx = 0; key_idx < kKeyNum; ++key_idx) {
+      EXPECT_TRUE(conn.Set(MakeKey(key_idx), kInitLabel));
+    }
+    txns[0].committed = conn.Commit();
+    EXPECT_TRUE(txns[0].committed);
+  }
+
+  constexpr int kWriterNum = 4;
+  constexpr int kReaderNum = 2;
+  constexpr int kWriterTxnNum = 300;
+  // Threads start together, so their transactions overlap.
+  std::atomic<int> started_thread_num{0};
+  std::atomic<int> finished_writer_num{0};
+  const auto wait_for_start = [&]() {
+    ++started_thread_num;
+    while (started_thread_num < kWriterNum + kReaderNum) {
+      std::this_thread::yield();
+    }
+  };
+  std::vector<std::vector<TxnRecord>> thread_txns(kWriterNum + kReaderNum);
+  std::vector<std::thread> threads;
+  for (int thd_idx = 0; thd_idx < kWriterNum; ++thd_idx) {
+    threads.emplace_back([&, thd_idx]() {
+      std::mt19937 rng(thd_idx);
+      wait_for_start();
+      for (int idx = 0; idx < kWriterTxnNum; ++idx) {
+        thread_txns[thd_idx].emplace_back(RunReadWriteTxn(
+            &db, isolation_level,
+            "w" + std::to_string(thd_idx) + "-" + std::to_string(idx), &rng));
+      }
+      ++finished_writer_num;
+    });
+  }
+  for (int thd_idx = kWriterNum; thd_idx < kWriterNum + kReaderNum;
+       ++thd_idx) {
+    threads.emplace_back([&, thd_idx]() {
+      wait_for_start();
+      int idx = 0;
+      do {
+        thread_txns[thd_idx].emplace_back(RunLongReadTxn(
+            &db, "r" + std::to_string(thd_idx) + "-" + std::to_string(idx),
+            /*read_only=*/idx % 2 == 0));
+        ++idx;
+      } while (finished_writer_num < kWriterNum);
+    });
+  }
+  for (auto& thd : threads) {
+    thd.join();
+  }
+
+  size_t committed_num = 0;
+  for (auto& cur_txns : thread_txns) {
+    for (auto& txn : cur_txns) {
+      committed_num += txn.committed;
+      txns.emplace_back(std::move(txn));
+    }
+  }
+  EXPECT_TRUE(committed_num > 0);
+  const auto stats = db.GetStats();
+  EXPECT_EQ(stats.begin_num, txns.size());
+  EXPECT_EQ(stats.commit_num, committed_num + 1);
+  EXPECT_EQ(stats.user_abort_num + stats.write_conflict_abort_num
+                + stats.serialization_abort_num,
+            txns.size() - committed_num - 1);
+  if (isolation_level == IsolationLevel::kReadCommittedIsolation
+      || isolation_level == IsolationLevel::kRepeatableReadIsolation) {
+    EXPECT_EQ(committed_num + 1, txns.size());
+  }
+
+  std::vector<std::string> final_values;
+  auto conn = db.CreateReadOnlyConn();
+  for (size_t key_idx = 0; key_idx < kKeyNum; ++key_idx) {
+    final_values.emplace_back(conn.Get(MakeKey(key_idx)).value_or(""));
+  }
+  EXPECT_TRUE(conn.Commit());
+  EXPECT_EQ(CheckHistory(isolation_level, txns, final_values), "");
+}
+
+// Testing senario: with GC disabled, version chain of a hot key keeps growing
+// while a long-running reader pins its snapshot, the reader scans the whole
+// chain but still sees its snapshot, and everything obsolete is pruned once
+// the reader finishes.
+void TestVersionChainGrowthWithoutGc() {
+  Database db{};
+  db.SetIsolationLevel(IsolationLevel::kSnapshotIsolation);
+  db.SetGcInterval(0);
+  {
+    auto conn = db.CreateConn();
+    for (size_t key_idx = 0; key_idx < kKeyNum; ++key_idx) {
+      EXPECT_TRUE(conn.Set(MakeKey(key_idx), kInitLabel));
+    }
+    EXPECT_TRUE(conn.Commit());
+  }
+
+  auto reader = db.CreateReadOnlyConn();
+  const auto hot_key = MakeKey(0);
+  EXPECT_EQ(reader.Get(hot_key).value_or(""), kInitLabel);
+
+  // Writers retry on conflicts until each update commits.
+  constexpr int kWriterNum = 4;
+  constexpr int kUpdateNum = 100;
+  std::atomic<int> finished_writer_num{0};
+  std::vector<std::thread> threads;
+  for (int thd_idx = 0; thd_idx < kWriterNum; ++thd_idx) {
+    threads.emplace_back([&, thd_idx]() {
+      for (int idx = 0; idx < kUpdateNum; ++idx) {
+        const auto value =
+            "w" + std::to_string(thd_idx) + "-" + std::to_string(idx);
+        for (;;) {
+          auto conn = db.CreateConn();
+          if (conn.Set(hot_key, value) && conn.Commit()) {
+            break;
+          }
+        }
+      }
+      ++finished_writer_num;
+    });
+  }
+  while (finished_writer_num < kWriterNum) {
+    EXPECT_EQ(reader.Get(hot_key).value_or(""), kInitLabel);
+  }
+  for (auto& thd : threads) {
+    thd.join();
+  }
+
+  // Aborted versions are rolled back eagerly, so the chain holds exactly one
+  // version per committed update.
+  constexpr size_t kCommittedNum = kWriterNum * kUpdateNum;
+  db.RunGc();
+  EXPECT_EQ(db.GetVersionNum(), kKeyNum + kCommittedNum);
+  auto stats = db.GetStats();
+  EXPECT_TRUE(stats.chain_length_histogram[DatabaseStats::GetBucket(
+                  kCommittedNum + 1)]
+              > 0);
+  const uint64_t scanned_version_num = stats.scanned_version_num;
+  EXPECT_EQ(reader.Get(hot_key).value_or(""), kInitLabel);
+  stats = db.GetStats();
+  EXPECT_TRUE(stats.scanned_version_num - scanned_version_num
+              >= kCommittedNum);
+  EXPECT_TRUE(reader.Commit());
+
+  db.RunGc();
+  EXPECT_EQ(db.GetVersionNum(), kKeyNum);
+  auto conn = db.CreateReadOnlyConn();
+  EXPECT_TRUE(conn.Get(hot_key).has_value());
+  EXPECT_EQ(db.GetStats().scanned_version_num - stats.scanned_version_num,
+            1u);
+  EXPECT_TRUE(conn.Commit());
+}
+
+}  // namespace mvcc
+
+int main(int argc, char** argv) {
+  mvcc::TestHistory(mvcc::IsolationLevel::kReadCommittedIsolation,
+                    mvcc::WriteConflictPolicy::kAtCommit);
+  mvcc::TestHistory(mvcc::IsolationLevel::kRepeatableReadIsolation,
+                    mvcc::WriteConflictPolicy::kAtCommit);
+  for (const auto policy :
+       {mvcc::WriteConflictPolicy::kAtCommit,
+        mvcc::WriteConflictPolicy::kNoWait,
+        mvcc::WriteConflictPolicy::kWaitDie}) {
+    mvcc::TestHistory(mvcc::IsolationLevel::kSnapshotIsolation, policy);
+    mvcc::TestHistory(mvcc::IsolationLevel::kSerializableIsolation, policy);
+  }
+  mvcc::TestVersionChainGrowthWithoutGc();
+  return 0;
+}
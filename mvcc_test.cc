@@ -1,45 +1,19 @@
-// TODO(hjiang): Use `googletest` instead of `assert`.
-
 #include "mvcc.h"
 
-#include <cassert>
-#include <iostream>
-
-namespace {
-
-template <typename T1, typename T2>
-bool CheckEqualityAndLog(const T1& lhs, const T2& rhs) {
-  if (lhs == rhs) {
-    return true;
-  }
-  std::cerr << "lhs: " << lhs << ", rhs: " << rhs << std::endl;
-  return false;
-}
-
-}  // namespace
-
-#define EXPECT_EQ(lhs, rhs)                             \
-  if (const auto& lhs_value = (lhs); true)              \
-    if (const auto& rhs_value = (rhs); true)            \
-      assert(CheckEqualityAndLog(lhs_value, rhs_value))
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
-#define EXPECT_TRUE(cond) assert((cond))
-#define EXPECT_FALSE(cond) assert(!(cond))
+#include "test_utils.h"
 
 namespace mvcc {
 
-namespace {
-
-void AssertHasKeyValue(Database* db, const KeyType& key,
-                       const ValueType& expected_value) {
-  auto conn = db->CreateConn();
-  auto actual_value = conn.Get(key);
-  EXPECT_TRUE(actual_value.has_value());
-  EXPECT_EQ(*actual_value, expected_value);
-}
-
-}  // namespace
-
 // Testing senario: testing key-value pair get and set operation in one
 // transaction.
 void TestGetAndSetInOneTxn() {
@@ -104,11 +78,11 @@ void TestMultipleTransactions_SnapshotIsolation() {
   EXPECT_TRUE(value.has_value());
   EXPECT_EQ(*value, "conn-1");
 
-  // Commit conn1 and check.
+  // Commit conn1 and check, conn2 still reads from its snapshot.
   conn1.Commit();
   value = conn2.Get("key");
   EXPECT_TRUE(value.has_value());
-  EXPECT_EQ(*value, "conn-1");
+  EXPECT_EQ(*value, "val");
 
   // Delete conn2 and check.
   EXPECT_TRUE(conn2.Delete("key"));
@@ -150,7 +124,8 @@ void TestMultipleTransactions_SerializableIsolation() {
   EXPECT_TRUE(conn1.Commit());
   EXPECT_TRUE(conn2.Commit());
 
-  // Check conn1 and conn2 with read-write conflict.
+  // Check conn3 and conn4 with a single rw-antidependency, which is
+  // serializable as conn3 followed by conn4.
   auto conn3 = db.CreateConn();
   auto conn4 = db.CreateConn();
   // Read operation for conn3.
@@ -160,7 +135,27 @@ void TestMultipleTransactions_SerializableIsolation() {
   // Write operation for conn4.
   conn4.Set("key", "another-val");
   EXPECT_TRUE(conn3.Commit());
-  EXPECT_FALSE(conn4.Commit());
+  EXPECT_TRUE(conn4.Commit());
+  AssertHasKeyValue(&db, "key", "another-val");
+
+  // Check conn5 and conn6 with write skew, where each reads what the other
+  // writes, which forms two consecutive rw-antidependencies.
+  {
+    auto conn = db.CreateConn();
+    conn.Set("another-key", "val");
+    EXPECT_TRUE(conn.Commit());
+  }
+  auto conn5 = db.CreateConn();
+  auto conn6 = db.CreateConn();
+  EXPECT_TRUE(conn5.Get("key").has_value());
+  EXPECT_TRUE(conn5.Get("another-key").has_value());
+  EXPECT_TRUE(conn6.Get("key").has_value());
+  EXPECT_TRUE(conn6.Get("another-key").has_value());
+  conn5.Set("key", "conn-5");
+  conn6.Set("another-key", "conn-6");
+  const bool committed5 = conn5.Commit();
+  const bool committed6 = conn6.Commit();
+  EXPECT_FALSE(committed5 && committed6);
 }
 
 void TestMultipleTransactions_RepeatableReadIsolation() {
@@ -235,8 +230,1233 @@ void TestMultipleTransactions_ReadCommitted() {
   value = conn2.Get("key");
   EXPECT_TRUE(value.has_value());
   EXPECT_EQ(*value, "txn-3");
+  // The latest committer wins, like on replay of its log.
+  EXPECT_TRUE(conn2.Commit());
+  AssertHasKeyValue(&db, "key", "txn-2");
+}
+
+// Testing senario: snapshot only observes transactions finished before it's
+// taken.
+void TestSnapshot() {
+  Snapshot snapshot;
+  snapshot.xmin = 3;
+  snapshot.xmax = 10;
+  snapshot.active_txns = {3, 5, 8};
+  EXPECT_TRUE(snapshot.HasFinished(1));
+  EXPECT_FALSE(snapshot.HasFinished(3));
+  EXPECT_TRUE(snapshot.HasFinished(4));
+  EXPECT_FALSE(snapshot.HasFinished(5));
+  EXPECT_TRUE(snapshot.HasFinished(9));
+  EXPECT_FALSE(snapshot.HasFinished(10));
+  EXPECT_FALSE(snapshot.HasFinished(11));
+
+  Database db{};
+  db.SetIsolationLevel(IsolationLevel::kSnapshotIsolation);
+  auto writer = db.CreateConn();
+  auto reader = db.CreateConn();
+  writer.Set("key", "val");
+  EXPECT_TRUE(writer.Commit());
+
+  // Neither in-progress transactions nor later ones are visible.
+  auto later_writer = db.CreateConn();
+  later_writer.Set("another-key", "val");
+  EXPECT_TRUE(later_writer.Commit());
+  EXPECT_FALSE(reader.Get("key").has_value());
+  EXPECT_FALSE(reader.Get("another-key").has_value());
+  AssertHasKeyValue(&db, "key", "val");
+  AssertHasKeyValue(&db, "another-key", "val");
+}
+
+// Testing senario: transaction states are kept in commit log, including the
+// ones across segments.
+void TestCommitLog() {
+  CommitLog commit_log;
+  constexpr TxnId kTxnId1 = 1;
+  constexpr TxnId kTxnId2 = (1 << 18) + 1;
+  commit_log.SetState(kTxnId1, TransactionState::kInProgress);
+  commit_log.SetState(kTxnId2, TransactionState::kInProgress);
+  EXPECT_TRUE(commit_log.GetState(kTxnId1) == TransactionState::kInProgress);
+  EXPECT_TRUE(commit_log.GetState(kTxnId2) == TransactionState::kInProgress);
+
+  commit_log.SetState(kTxnId1, TransactionState::kCommitted);
+  commit_log.SetState(kTxnId2, TransactionState::kAborted);
+  EXPECT_TRUE(commit_log.GetState(kTxnId1) == TransactionState::kCommitted);
+  EXPECT_TRUE(commit_log.GetState(kTxnId2) == TransactionState::kAborted);
+  EXPECT_TRUE(commit_log.GetState(kTxnId1 + 1) == TransactionState::kInvalid);
+}
+
+// Testing senario: aborted transactions remove their versions without GC,
+// whether aborted by user or on conflict.
+void TestAbortCompaction() {
+  Database db{};
+  db.SetIsolationLevel(IsolationLevel::kSnapshotIsolation);
+  db.SetGcInterval(0);
+  {
+    auto conn = db.CreateConn();
+    conn.Set("key", "val");
+    EXPECT_TRUE(conn.Commit());
+  }
+
+  {
+    auto conn = db.CreateConn();
+    conn.Set("key", "aborted");
+    conn.Set("new-key", "aborted");
+    EXPECT_TRUE(conn.Delete("key"));
+    EXPECT_EQ(db.GetVersionNum(), 3u);
+    conn.Abort();
+  }
+  EXPECT_EQ(db.GetVersionNum(), 1u);
+  AssertHasKeyValue(&db, "key", "val");
+
+  // Loser of first-committer-wins leaves nothing behind either, including
+  // versions under a concurrent read committed writer.
+  auto conn1 = db.CreateConn();
+  auto conn2 = db.CreateConn();
+  auto conn3 = db.CreateConn(IsolationLevel::kReadCommittedIsolation);
+  conn1.Set("key", "val-1");
+  conn2.Set("key", "val-2");
+  conn3.Set("key", "val-3");
+  conn2.Set("key", "val-2-again");
+  EXPECT_TRUE(conn1.Commit());
+  EXPECT_FALSE(conn2.Commit());
+  EXPECT_EQ(db.GetVersionNum(), 3u);
+  EXPECT_TRUE(conn3.Commit());
+  AssertHasKeyValue(&db, "key", "val-3");
+}
+
+// Testing senario: reads stop at the newest visible version, and repeated
+// writes by one transaction only overwrite the head.
+void TestVersionChain() {
+  Database db{};
+  db.SetIsolationLevel(IsolationLevel::kSnapshotIsolation);
+  db.SetGcInterval(0);
+
+  {
+    auto conn = db.CreateConn();
+    conn.Set("key", "val-1");
+    conn.Set("key", "val-2");
+    EXPECT_TRUE(conn.Delete("key"));
+    EXPECT_FALSE(conn.Delete("key"));
+    EXPECT_FALSE(conn.Get("key").has_value());
+    conn.Set("key", "val-3");
+    EXPECT_TRUE(conn.Commit());
+  }
+  EXPECT_EQ(db.GetVersionNum(), 1u);
+
+  // Uncommitted versions at the head are skipped, and aborted ones are
+  // removed at once.
+  auto writer = db.CreateConn();
+  writer.Set("key", "uncommitted");
+  {
+    auto conn = db.CreateConn();
+    conn.Set("key", "aborted");
+    conn.Abort();
+  }
+  EXPECT_EQ(db.GetVersionNum(), 2u);
+  AssertHasKeyValue(&db, "key", "val-3");
+  writer.Abort();
+
+  // Aborted versions are pruned by GC.
+  db.RunGc();
+  {
+    auto conn = db.CreateConn();
+    conn.Set("key", "val-4");
+    EXPECT_TRUE(conn.Commit());
+  }
+  EXPECT_EQ(db.GetVersionNum(), 2u);
+  AssertHasKeyValue(&db, "key", "val-4");
+}
+
+// Testing senario: released versions are reset and recycled by version pool,
+// along with their older versions.
+void TestVersionPool() {
+  VersionPool pool;
+  EXPECT_EQ(pool.GetAllocatedNum(), 0u);
+
+  auto version = pool.Allocate();
+  version->value = "val";
+  version->start_txn_id = 1;
+  version->older = pool.Allocate();
+  EXPECT_EQ(pool.GetAllocatedNum(), 2u);
+  const ValueWrapper* released = version.get();
+
+  // Released versions are reset and recycled, older ones get released along.
+  version.reset();
+  EXPECT_EQ(pool.GetAllocatedNum(), 0u);
+  auto recycled = pool.Allocate();
+  EXPECT_TRUE(recycled.get() == released);
+  EXPECT_TRUE(recycled->value.empty());
+  EXPECT_EQ(recycled->start_txn_id, kInvalidTxnId);
+  EXPECT_EQ(pool.GetAllocatedNum(), 1u);
+}
+
+// Testing senario: small values are packed inline, and larger ones go to heap,
+// either kind could replace the other.
+void TestPackedValue() {
+  PackedValue value;
+  EXPECT_TRUE(value.empty());
+  const std::string small(PackedValue::kInlineCapacity, 's');
+  const std::string large(PackedValue::kInlineCapacity + 1, 'l');
+  value = small;
+  EXPECT_EQ(value.view(), small);
+  value = large;
+  EXPECT_EQ(value.view(), large);
+  value = "16-byte-counter!";
+  EXPECT_EQ(value.view(), "16-byte-counter!");
+  value = std::string(1000, 'v');
+  EXPECT_EQ(value.view().size(), 1000u);
+  value.Clear();
+  EXPECT_TRUE(value.empty());
+  // Cleared large values still take either kind.
+  value = large;
+  value.Clear();
+  value = small;
+  EXPECT_EQ(value.view(), small);
+  value = large;
+  value.Clear();
+  value = large;
+  EXPECT_EQ(value.view(), large);
+
+  Database db{};
+  {
+    auto conn = db.CreateConn();
+    conn.Set("small", small);
+    conn.Set("large", large);
+    EXPECT_TRUE(conn.Commit());
+  }
+  AssertHasKeyValue(&db, "small", small);
+  AssertHasKeyValue(&db, "large", large);
+}
+
+// Testing senario: value lent out by [GetView] stays valid while concurrent
+// transactions overwrite and delete the key, and garbage gets collected.
+void TestGetView() {
+  Database db{};
+  db.SetIsolationLevel(IsolationLevel::kSnapshotIsolation);
+  const std::string value(4096, 'v');
+  {
+    auto conn = db.CreateConn();
+    conn.Set("key", value);
+    EXPECT_TRUE(conn.Commit());
+  }
+
+  auto reader = db.CreateConn();
+  // Probe with a key not owned by any `std::string`.
+  const char key_buf[] = {'k', 'e', 'y', '-', '1'};
+  const std::string_view key(key_buf, 3);
+  const auto view = reader.GetView(key);
+  EXPECT_TRUE(view.has_value());
+  EXPECT_FALSE(reader.GetView(std::string_view(key_buf, 5)).has_value());
+
+  for (int idx = 0; idx < 10; ++idx) {
+    auto conn = db.CreateConn();
+    conn.Set("key", std::to_string(idx));
+    EXPECT_TRUE(conn.Commit());
+  }
+  {
+    auto conn = db.CreateConn();
+    EXPECT_TRUE(conn.Delete(key));
+    EXPECT_TRUE(conn.Commit());
+  }
+  db.RunGc();
+  EXPECT_TRUE(*view == value);
+  EXPECT_TRUE(reader.Commit());
+
+  db.RunGc();
+  EXPECT_EQ(db.GetVersionNum(), 0u);
+}
+
+// Testing senario: batched writes apply in batch order for the same key, and
+// batched reads see them as point reads do.
+void TestMultiGetAndWriteBatch() {
+  Database db{};
+  db.SetIsolationLevel(IsolationLevel::kSnapshotIsolation);
+  {
+    auto conn = db.CreateConn();
+    conn.Set("existing-key", "val");
+    conn.Set("deleted-key", "val");
+    EXPECT_TRUE(conn.Commit());
+  }
+
+  constexpr int kKeyNum = 200;
+  auto conn = db.CreateConn();
+  WriteBatch batch;
+  for (int idx = 0; idx < kKeyNum; ++idx) {
+    batch.Set("key-" + std::to_string(idx), std::to_string(idx));
+  }
+  batch.Set("existing-key", "new-val");
+  batch.Delete("deleted-key");
+  batch.Delete("absent-key");
+  batch.Set("reset-key", "val");
+  batch.Delete("reset-key");
+  batch.Set("reset-key", "new-val");
+  batch.Delete("key-0");
+  EXPECT_EQ(batch.size(), static_cast<size_t>(kKeyNum + 7));
+  conn.Write(std::move(batch));
+  // Deleting the absent key leaves no empty chain behind.
+  db.RunGc();
+  const auto stats = db.GetStats();
+  EXPECT_EQ(stats.chain_length_histogram[0], 0u);
+
+  std::vector<std::string> key_storage;
+  for (int idx = 0; idx < kKeyNum; ++idx) {
+    key_storage.emplace_back("key-" + std::to_string(idx));
+  }
+  std::vector<std::string_view> keys(key_storage.begin(), key_storage.end());
+  keys.emplace_back("existing-key");
+  keys.emplace_back("deleted-key");
+  keys.emplace_back("absent-key");
+  keys.emplace_back("reset-key");
+  keys.emplace_back("key-1");
+  const auto values = conn.MultiGet(keys);
+  EXPECT_EQ(values.size(), keys.size());
+  EXPECT_FALSE(values[0].has_value());
+  for (int idx = 1; idx < kKeyNum; ++idx) {
+    EXPECT_TRUE(values[idx] == std::to_string(idx));
+  }
+  EXPECT_TRUE(values[kKeyNum] == "new-val");
+  EXPECT_FALSE(values[kKeyNum + 1].has_value());
+  EXPECT_FALSE(values[kKeyNum + 2].has_value());
+  EXPECT_TRUE(values[kKeyNum + 3] == "new-val");
+  EXPECT_TRUE(values[kKeyNum + 4] == "1");
+  EXPECT_TRUE(conn.Commit());
+
+  AssertHasKeyValue(&db, "existing-key", "new-val");
+  AssertHasKeyValue(&db, "reset-key", "new-val");
+  auto reader = db.CreateConn();
+  EXPECT_FALSE(reader.Get("deleted-key").has_value());
+  EXPECT_FALSE(reader.Get("key-0").has_value());
+}
+
+// Testing senario: read-only transactions read from their snapshots, and hold
+// back garbage collection until they finish, including ones falling back to
+// regular transactions when reader registry is full.
+void TestReadOnlyTransactions() {
+  Database db{};
+  db.SetIsolationLevel(IsolationLevel::kSnapshotIsolation);
+  {
+    auto conn = db.CreateConn();
+    conn.Set("key", "val-0");
+    EXPECT_TRUE(conn.Commit());
+  }
+
+  auto in_progress = db.CreateConn();
+  in_progress.Set("key", "uncommitted");
+  constexpr size_t kReaderNum = 300;
+  std::vector<Connection> readers;
+  for (size_t idx = 0; idx < kReaderNum; ++idx) {
+    readers.emplace_back(db.CreateReadOnlyConn());
+  }
+  EXPECT_TRUE(in_progress.Commit());
+  for (int idx = 1; idx <= 5; ++idx) {
+    auto conn = db.CreateConn();
+    conn.Set("key", "val-" + std::to_string(idx));
+    EXPECT_TRUE(conn.Commit());
+  }
+
+  db.RunGc();
+  EXPECT_EQ(db.GetVersionNum(), 7u);
+  for (auto& reader : readers) {
+    const auto value = reader.Get("key");
+    EXPECT_TRUE(value == "val-0");
+    EXPECT_TRUE(reader.Commit());
+  }
+  db.RunGc();
+  EXPECT_EQ(db.GetVersionNum(), 1u);
+
+  auto reader = db.CreateReadOnlyConn();
+  AssertHasKeyValue(&db, "key", "val-5");
+  reader.Abort();
+}
+
+// Testing senario: first committer wins, no matter which of the concurrent
+// transactions starts first.
+void TestFirstCommitterWins() {
+  Database db{};
+  db.SetIsolationLevel(IsolationLevel::kSnapshotIsolation);
+
+  // Write-write conflict with a transaction started later.
+  auto conn1 = db.CreateConn();
+  auto conn2 = db.CreateConn();
+  conn1.Set("key", "conn-1");
+  conn2.Set("key", "conn-2");
   EXPECT_TRUE(conn2.Commit());
-  AssertHasKeyValue(&db, "key", "txn-3");
+  EXPECT_FALSE(conn1.Commit());
+  AssertHasKeyValue(&db, "key", "conn-2");
+
+  // Non-overlapping write sets.
+  auto conn3 = db.CreateConn();
+  auto conn4 = db.CreateConn();
+  conn3.Set("key", "conn-3");
+  conn4.Set("another-key", "conn-4");
+  EXPECT_TRUE(conn4.Commit());
+  EXPECT_TRUE(conn3.Commit());
+  AssertHasKeyValue(&db, "key", "conn-3");
+  AssertHasKeyValue(&db, "another-key", "conn-4");
+
+  // Serializable transactions follow first-committer-wins as well.
+  db.SetIsolationLevel(IsolationLevel::kSerializableIsolation);
+  auto conn5 = db.CreateConn();
+  auto conn6 = db.CreateConn();
+  conn6.Set("key", "conn-6");
+  conn5.Set("key", "conn-5");
+  EXPECT_TRUE(conn5.Commit());
+  EXPECT_FALSE(conn6.Commit());
+  AssertHasKeyValue(&db, "key", "conn-5");
+}
+
+// Testing senario: a committed pivot of dangerous structure dooms the
+// transaction completing the structure, even if it's read-only.
+void TestSerializableSnapshotIsolation_CommittedPivot() {
+  Database db{};
+  db.SetIsolationLevel(IsolationLevel::kSerializableIsolation);
+  {
+    auto conn = db.CreateConn();
+    conn.Set("x", "0");
+    conn.Set("y", "0");
+    EXPECT_TRUE(conn.Commit());
+  }
+
+  // conn2 -rw-> conn3, and conn3 commits before conn1 starts.
+  auto conn2 = db.CreateConn();
+  auto conn3 = db.CreateConn();
+  EXPECT_TRUE(conn2.Get("y").has_value());
+  conn3.Set("y", "1");
+  EXPECT_TRUE(conn3.Commit());
+  auto conn1 = db.CreateConn();
+  auto value = conn1.Get("y");
+  EXPECT_TRUE(value.has_value());
+  EXPECT_EQ(*value, "1");
+
+  // conn2 commits with only outgoing rw-antidependency.
+  conn2.Set("x", "1");
+  EXPECT_TRUE(conn2.Commit());
+
+  // conn1 -rw-> conn2 makes a cycle conn1 -> conn2 -> conn3 -> conn1.
+  value = conn1.Get("x");
+  EXPECT_TRUE(value.has_value());
+  EXPECT_EQ(*value, "0");
+  EXPECT_FALSE(conn1.Commit());
+}
+
+// Testing senario: concurrent increments on a shared counter and on
+// per-thread keys, no update should be lost.
+void TestConcurrentTransactions(IsolationLevel isolation_level) {
+  Database db{};
+  db.SetIsolationLevel(isolation_level);
+
+  {
+    auto conn = db.CreateConn();
+    conn.Set("counter", "0");
+    EXPECT_TRUE(conn.Commit());
+  }
+
+  constexpr int kThreadNum = 8;
+  constexpr int kIterationNum = 200;
+  std::atomic<int> committed_num{0};
+  std::vector<std::thread> threads;
+  threads.reserve(kThreadNum);
+  for (int thd_idx = 0; thd_idx < kThreadNum; ++thd_idx) {
+    threads.emplace_back([&db, &committed_num, thd_idx]() {
+      const auto own_key = "key-" + std::to_string(thd_idx);
+      for (int iter = 0; iter < kIterationNum; ++iter) {
+        // Low-contention write, which should always succeed.
+        {
+          auto conn = db.CreateConn();
+          conn.Set(own_key, std::to_string(iter));
+          EXPECT_TRUE(conn.Commit());
+        }
+
+        // High-contention read-modify-write, which could fail.
+        auto conn = db.CreateConn();
+        auto value = conn.Get("counter");
+        EXPECT_TRUE(value.has_value());
+        conn.Set("counter", std::to_string(std::stoi(*value) + 1));
+        if (conn.Commit()) {
+          ++committed_num;
+        }
+      }
+    });
+  }
+  for (auto& cur_thread : threads) {
+    cur_thread.join();
+  }
+
+  EXPECT_TRUE(committed_num.load() > 0);
+  AssertHasKeyValue(&db, "counter", std::to_string(committed_num.load()));
+  for (int thd_idx = 0; thd_idx < kThreadNum; ++thd_idx) {
+    AssertHasKeyValue(&db, "key-" + std::to_string(thd_idx),
+                      std::to_string(kIterationNum - 1));
+  }
+}
+
+// Testing senario: obsolete versions are garbage collected, while versions
+// visible to in-progress transactions are kept.
+void TestGarbageCollection() {
+  Database db{};
+  db.SetIsolationLevel(IsolationLevel::kSnapshotIsolation);
+  db.SetGcInterval(0);
+
+  constexpr size_t kKeyNum = 10;
+  constexpr size_t kVersionNum = 20;
+  for (size_t version = 0; version < kVersionNum; ++version) {
+    auto conn = db.CreateConn();
+    for (size_t key = 0; key < kKeyNum; ++key) {
+      conn.Set(std::to_string(key), std::to_string(version));
+    }
+    EXPECT_TRUE(conn.Commit());
+  }
+  {
+    auto conn = db.CreateConn();
+    conn.Set("aborted", "val");
+    conn.Abort();
+  }
+
+  // In-progress transaction pins the versions it could see.
+  auto reader = db.CreateConn();
+  {
+    auto conn = db.CreateConn();
+    conn.Set("0", "new-val");
+    EXPECT_TRUE(conn.Delete("1"));
+    EXPECT_TRUE(conn.Commit());
+  }
+  // Latest committed version for each key, plus the new value and the
+  // tombstone invisible to reader.
+  db.RunGc();
+  EXPECT_EQ(db.GetVersionNum(), kKeyNum + 2);
+  auto value = reader.Get("0");
+  EXPECT_TRUE(value.has_value());
+  EXPECT_EQ(*value, std::to_string(kVersionNum - 1));
+  value = reader.Get("1");
+  EXPECT_TRUE(value.has_value());
+  EXPECT_TRUE(reader.Commit());
+
+  // Everything obsolete gets pruned after the reader finishes.
+  db.RunGc();
+  EXPECT_EQ(db.GetVersionNum(), kKeyNum - 1);
+  AssertHasKeyValue(&db, "0", "new-val");
+  AssertHasKeyValue(&db, "2", std::to_string(kVersionNum - 1));
+  auto conn = db.CreateConn();
+  EXPECT_FALSE(conn.Get("1").has_value());
+  EXPECT_FALSE(conn.Get("aborted").has_value());
+}
+
+// Testing senario: range scan returns pairs in key order across storage
+// shards, and sees a consistent snapshot while writers keep committing.
+void TestScan() {
+  Database db{};
+  db.SetIsolationLevel(IsolationLevel::kSnapshotIsolation);
+
+  auto key_of = [](int idx) {
+    std::string key = std::to_string(idx);
+    return "key-" + std::string(4 - key.size(), '0') + key;
+  };
+  constexpr int kKeyNum = 1000;
+  {
+    auto conn = db.CreateConn();
+    for (int idx = 0; idx < kKeyNum; ++idx) {
+      conn.Set(key_of(idx), std::to_string(idx));
+    }
+    EXPECT_TRUE(conn.Commit());
+  }
+
+  auto reader = db.CreateConn();
+  {
+    auto conn = db.CreateConn();
+    EXPECT_TRUE(conn.Delete(key_of(100)));
+    conn.Set(key_of(101), "new-val");
+    conn.Set(key_of(100) + "-new", "new-val");
+    EXPECT_TRUE(conn.Commit());
+  }
+  {
+    // Own uncommitted writes are visible to the writer.
+    auto conn = db.CreateConn();
+    conn.Set(key_of(200) + "-new", "new-val");
+    EXPECT_TRUE(conn.Delete(key_of(201)));
+    std::vector<std::string> keys;
+    for (auto iter = conn.Scan(key_of(200), key_of(203)); iter.Valid();
+         iter.Next()) {
+      keys.emplace_back(iter.key());
+    }
+    const std::vector<std::string> expected{
+        key_of(200), key_of(200) + "-new", key_of(202)};
+    EXPECT_TRUE(keys == expected);
+  }
+
+  // Reader's snapshot doesn't see deletion and updates after it starts.
+  int idx = 0;
+  for (auto iter = reader.Scan(key_of(0), key_of(kKeyNum)); iter.Valid();
+       iter.Next(), ++idx) {
+    EXPECT_EQ(iter.key(), key_of(idx));
+    EXPECT_EQ(iter.value(), std::to_string(idx));
+  }
+  EXPECT_EQ(idx, kKeyNum);
+  EXPECT_TRUE(reader.Commit());
+
+  auto conn = db.CreateConn();
+  auto iter = conn.Scan(key_of(99), key_of(102));
+  EXPECT_TRUE(iter.Valid());
+  EXPECT_EQ(iter.key(), key_of(99));
+  iter.Next();
+  EXPECT_EQ(iter.key(), key_of(100) + "-new");
+  iter.Next();
+  EXPECT_EQ(iter.key(), key_of(101));
+  EXPECT_EQ(iter.value(), "new-val");
+  iter.Next();
+  EXPECT_FALSE(iter.Valid());
+  EXPECT_FALSE(conn.Scan(key_of(5), key_of(5)).Valid());
+}
+
+// Testing senario: range fingerprint never rules out keys within added
+// ranges, and rules out keys sharing no prefix with them.
+void TestRangeFingerprint() {
+  RangeFingerprint fingerprint;
+  const auto may_contain = [&fingerprint](std::string_view key) {
+    return fingerprint.MayContain(RangeFingerprint::HashKey(key));
+  };
+  EXPECT_FALSE(may_contain("on-call-alice"));
+
+  fingerprint.Add("on-call-", "on-call.");
+  fingerprint.Add("tenant/123/user/", "tenant/123/user0");
+  fingerprint.Add("key", std::string("key") + '\0');
+  EXPECT_TRUE(may_contain("on-call-alice"));
+  EXPECT_TRUE(may_contain("on-call-"));
+  EXPECT_TRUE(may_contain("tenant/123/user/456"));
+  EXPECT_TRUE(may_contain("key"));
+  EXPECT_FALSE(may_contain("other-key"));
+  EXPECT_FALSE(may_contain("on"));
+  EXPECT_FALSE(may_contain(""));
+
+  // Range without common prefix could contain any key.
+  fingerprint.Add("a", "z");
+  EXPECT_TRUE(may_contain("other-key"));
+  EXPECT_TRUE(may_contain(""));
+}
+
+// Testing senario: absent keys read by serializable transactions are
+// interned, and conflicts are still detected on them, including insertions
+// into interned keys which concurrent transactions have scanned.
+void TestSerializableInternedKeys() {
+  Database db{};
+  db.SetIsolationLevel(IsolationLevel::kSerializableIsolation);
+
+  // Each inserts the absent key the other one reads by batch.
+  {
+    auto conn1 = db.CreateConn();
+    auto conn2 = db.CreateConn();
+    const std::vector<std::string_view> keys1{"key-x", "key-z"};
+    const std::vector<std::string_view> keys2{"key-y"};
+    for (const auto& value : conn1.MultiGet(keys1)) {
+      EXPECT_FALSE(value.has_value());
+    }
+    EXPECT_FALSE(conn2.MultiGet(keys2)[0].has_value());
+    EXPECT_TRUE(conn1.Set("key-y", "val"));
+    EXPECT_TRUE(conn2.Set("key-x", "val"));
+    const bool committed1 = conn1.Commit();
+    const bool committed2 = conn2.Commit();
+    EXPECT_FALSE(committed1 && committed2);
+  }
+
+  // Insert into a scanned range, via a key interned by another reader.
+  {
+    auto conn1 = db.CreateConn();
+    auto conn2 = db.CreateConn();
+    EXPECT_FALSE(conn1.Scan("slot-", "slot.").Valid());
+    {
+      auto reader = db.CreateConn();
+      EXPECT_FALSE(reader.Get("slot-a").has_value());
+      EXPECT_TRUE(reader.Commit());
+    }
+    EXPECT_FALSE(conn2.Get("flag").has_value());
+    EXPECT_TRUE(conn1.Set("flag", "val"));
+    EXPECT_TRUE(conn2.Set("slot-a", "val"));
+    const bool committed1 = conn1.Commit();
+    const bool committed2 = conn2.Commit();
+    EXPECT_FALSE(committed1 && committed2);
+  }
+
+  // Each inserts the absent key the other one fails to delete.
+  {
+    auto conn1 = db.CreateConn();
+    auto conn2 = db.CreateConn();
+    EXPECT_FALSE(conn1.Delete("del-a"));
+    EXPECT_FALSE(conn2.Delete("del-b"));
+    EXPECT_TRUE(conn1.Set("del-b", "val"));
+    EXPECT_TRUE(conn2.Set("del-a", "val"));
+    const bool committed1 = conn1.Commit();
+    const bool committed2 = conn2.Commit();
+    EXPECT_FALSE(committed1 && committed2);
+  }
+
+  // Interned keys are invisible, and dropped by GC once readers finish.
+  db.RunGc();
+  auto conn = db.CreateConn();
+  EXPECT_FALSE(conn.Get("key-z").has_value());
+  EXPECT_FALSE(conn.Scan("key-z", "key-{").Valid());
+  EXPECT_TRUE(conn.Commit());
+}
+
+// Testing senario: serializable transactions detect phantoms, aka write skew
+// via keys inserted into what concurrent transactions have read as absent.
+void TestSerializablePhantom() {
+  Database db{};
+  db.SetIsolationLevel(IsolationLevel::kSerializableIsolation);
+  {
+    auto conn = db.CreateConn();
+    conn.Set("other-key", "val");
+    EXPECT_TRUE(conn.Commit());
+  }
+
+  // Both check no one is on call by range scan, then put themselves on call.
+  {
+    auto conn1 = db.CreateConn();
+    auto conn2 = db.CreateConn();
+    EXPECT_FALSE(conn1.Scan("on-call-", "on-call.").Valid());
+    EXPECT_FALSE(conn2.Scan("on-call-", "on-call.").Valid());
+    conn1.Set("on-call-alice", "true");
+    conn2.Set("on-call-bob", "true");
+    const bool committed1 = conn1.Commit();
+    const bool committed2 = conn2.Commit();
+    EXPECT_FALSE(committed1 && committed2);
+  }
+
+  // Each inserts the absent key the other one reads.
+  {
+    auto conn1 = db.CreateConn();
+    auto conn2 = db.CreateConn();
+    EXPECT_FALSE(conn1.Get("key-x").has_value());
+    EXPECT_FALSE(conn2.Get("key-y").has_value());
+    conn1.Set("key-y", "val");
+    conn2.Set("key-x", "val");
+    const bool committed1 = conn1.Commit();
+    const bool committed2 = conn2.Commit();
+    EXPECT_FALSE(committed1 && committed2);
+  }
+
+  // Insertion outside of read ranges doesn't conflict, nor does insertion
+  // into a range read by a reader which has finished.
+  {
+    auto reader = db.CreateConn();
+    EXPECT_FALSE(reader.Scan("range-c-", "range-c.").Valid());
+    EXPECT_TRUE(reader.Commit());
+
+    auto conn1 = db.CreateConn();
+    auto conn2 = db.CreateConn();
+    EXPECT_FALSE(conn1.Scan("range-a-", "range-a.").Valid());
+    EXPECT_FALSE(conn2.Scan("range-b-", "range-b.").Valid());
+    conn1.Set("range-c-key", "val");
+    conn2.Set("range-d-key", "val");
+    EXPECT_TRUE(conn1.Commit());
+    EXPECT_TRUE(conn2.Commit());
+  }
+}
+
+// Testing senario: transactions at different isolation levels run on the same
+// data, each with the guarantees of its own level.
+void TestMixedIsolationLevels() {
+  Database db{};
+  db.SetIsolationLevel(IsolationLevel::kSerializableIsolation);
+  {
+    auto conn = db.CreateConn();
+    conn.Set("x", "0");
+    conn.Set("y", "0");
+    EXPECT_TRUE(conn.Commit());
+  }
+
+  // Read committed reader sees the latest commit, snapshot reader doesn't.
+  {
+    auto rc_conn = db.CreateConn(IsolationLevel::kReadCommittedIsolation);
+    auto si_conn = db.CreateConn(IsolationLevel::kSnapshotIsolation);
+    AssertHasKeyValue(&db, "x", "0");
+    {
+      auto conn = db.CreateConn(IsolationLevel::kReadCommittedIsolation);
+      conn.Set("x", "1");
+      EXPECT_TRUE(conn.Commit());
+    }
+    EXPECT_EQ(rc_conn.Get("x").value_or(""), "1");
+    EXPECT_EQ(si_conn.Get("x").value_or(""), "0");
+    EXPECT_TRUE(rc_conn.Commit());
+    EXPECT_TRUE(si_conn.Commit());
+  }
+
+  // Snapshot isolation writer loses to a committed read committed writer,
+  // but not the other way around.
+  {
+    auto si_conn = db.CreateConn(IsolationLevel::kSnapshotIsolation);
+    auto rc_conn = db.CreateConn(IsolationLevel::kReadCommittedIsolation);
+    si_conn.Set("x", "2");
+    rc_conn.Set("x", "3");
+    EXPECT_TRUE(rc_conn.Commit());
+    EXPECT_FALSE(si_conn.Commit());
+  }
+  {
+    auto rc_conn = db.CreateConn(IsolationLevel::kReadCommittedIsolation);
+    auto si_conn = db.CreateConn(IsolationLevel::kSnapshotIsolation);
+    rc_conn.Set("x", "4");
+    si_conn.Set("x", "5");
+    EXPECT_TRUE(si_conn.Commit());
+    EXPECT_TRUE(rc_conn.Commit());
+  }
+
+  // Write skew is prevented between serializable transactions only.
+  {
+    auto conn1 = db.CreateConn();
+    auto conn2 = db.CreateConn();
+    EXPECT_TRUE(conn1.Get("x").has_value());
+    EXPECT_TRUE(conn2.Get("y").has_value());
+    conn1.Set("y", "1");
+    conn2.Set("x", "1");
+    const bool committed1 = conn1.Commit();
+    const bool committed2 = conn2.Commit();
+    EXPECT_FALSE(committed1 && committed2);
+  }
+  {
+    auto ser_conn = db.CreateConn();
+    auto si_conn = db.CreateConn(IsolationLevel::kSnapshotIsolation);
+    EXPECT_TRUE(ser_conn.Get("x").has_value());
+    EXPECT_TRUE(si_conn.Get("y").has_value());
+    ser_conn.Set("y", "2");
+    si_conn.Set("x", "2");
+    EXPECT_TRUE(ser_conn.Commit());
+    EXPECT_TRUE(si_conn.Commit());
+  }
+
+  // Read-only connections at a weaker level skip serializable tracking.
+  {
+    auto conn = db.CreateReadOnlyConn(IsolationLevel::kSnapshotIsolation);
+    EXPECT_EQ(conn.Get("x").value_or(""), "2");
+    EXPECT_TRUE(conn.Commit());
+  }
+}
+
+// Testing senario: write-write conflicts are detected at write time with eager
+// policies, so the loser fails fast.
+void TestEagerWriteConflict() {
+  Database db{};
+  db.SetIsolationLevel(IsolationLevel::kSnapshotIsolation);
+  db.SetWriteConflictPolicy(WriteConflictPolicy::kNoWait);
+  {
+    auto conn = db.CreateConn();
+    EXPECT_TRUE(conn.Set("x", "0"));
+    EXPECT_TRUE(conn.Commit());
+  }
+
+  // First updater wins, no matter who commits first; further writes by the
+  // loser fail at once.
+  {
+    auto conn1 = db.CreateConn();
+    auto conn2 = db.CreateConn();
+    EXPECT_TRUE(conn1.Set("x", "1"));
+    EXPECT_FALSE(conn2.Set("x", "2"));
+    EXPECT_FALSE(conn2.Set("y", "2"));
+    EXPECT_FALSE(conn2.Delete("x"));
+    EXPECT_FALSE(conn2.Commit());
+    EXPECT_TRUE(conn1.Set("x", "3"));
+    EXPECT_TRUE(conn1.Commit());
+    AssertHasKeyValue(&db, "x", "3");
+  }
+
+  // Concurrent committed writer conflicts as well, while an aborted writer
+  // doesn't.
+  {
+    auto conn1 = db.CreateConn();
+    {
+      auto conn2 = db.CreateConn();
+      EXPECT_TRUE(conn2.Set("x", "4"));
+      EXPECT_TRUE(conn2.Commit());
+      auto conn3 = db.CreateConn();
+      EXPECT_TRUE(conn3.Set("y", "4"));
+      conn3.Abort();
+    }
+    EXPECT_TRUE(conn1.Set("y", "5"));
+    WriteBatch batch;
+    batch.Set("x", "5");
+    EXPECT_FALSE(conn1.Write(std::move(batch)));
+    EXPECT_FALSE(conn1.Commit());
+  }
+
+  // Read committed transactions don't check conflicts.
+  {
+    auto conn1 = db.CreateConn();
+    auto conn2 = db.CreateConn(IsolationLevel::kReadCommittedIsolation);
+    EXPECT_TRUE(conn1.Set("x", "6"));
+    EXPECT_TRUE(conn2.Set("x", "7"));
+    EXPECT_TRUE(conn1.Commit());
+    EXPECT_TRUE(conn2.Commit());
+  }
+
+  // Wait-die: younger transaction dies, older one waits for the younger
+  // writer, and goes on once it aborts.
+  db.SetWriteConflictPolicy(WriteConflictPolicy::kWaitDie);
+  {
+    auto older = db.CreateConn();
+    auto younger = db.CreateConn();
+    EXPECT_TRUE(older.Set("x", "8"));
+    EXPECT_FALSE(younger.Set("x", "9"));
+    EXPECT_FALSE(younger.Commit());
+    EXPECT_TRUE(older.Commit());
+  }
+  {
+    auto older = db.CreateConn();
+    auto younger = db.CreateConn();
+    EXPECT_TRUE(younger.Set("x", "10"));
+    std::atomic<bool> written{false};
+    std::thread waiter([&] {
+      EXPECT_TRUE(older.Set("x", "11"));
+      written = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_FALSE(written);
+    younger.Abort();
+    waiter.join();
+    EXPECT_TRUE(older.Commit());
+    AssertHasKeyValue(&db, "x", "11");
+  }
+
+  const auto stats = db.GetStats();
+  EXPECT_EQ(stats.write_conflict_abort_num, 3u);
+}
+
+// Testing senario: databases sharing one timestamp oracle allocate txn ids in
+// ranges, while visibility keeps working across the gaps.
+void TestTimestampOracle() {
+  // Records allocated ranges.
+  class RecordingOracle : public CounterTimestampOracle {
+   public:
+    TxnId AllocateRange(uint64_t num) override {
+      const TxnId range_begin = CounterTimestampOracle::AllocateRange(num);
+      range_begins.emplace_back(range_begin);
+      return range_begin;
+    }
+
+    std::vector<TxnId> range_begins;
+  };
+
+  constexpr uint64_t kBatchSize = 2;
+  auto oracle = std::make_shared<RecordingOracle>();
+  Database db1{};
+  Database db2{};
+  db1.SetTimestampOracle(oracle, kBatchSize);
+  db2.SetTimestampOracle(oracle, kBatchSize);
+
+  auto reader = db1.CreateConn();
+  EXPECT_FALSE(reader.Get("key").has_value());
+  for (int idx = 0; idx < 3; ++idx) {
+    for (auto* db : {&db1, &db2}) {
+      auto conn = db->CreateConn();
+      conn.Set("key", std::to_string(idx));
+      EXPECT_TRUE(conn.Commit());
+    }
+  }
+  // Snapshot taken before the jumps still excludes later transactions, and
+  // conflicts with them.
+  EXPECT_FALSE(reader.Get("key").has_value());
+  reader.Set("key", "reader");
+  EXPECT_FALSE(reader.Commit());
+  AssertHasKeyValue(&db1, "key", "2");
+  AssertHasKeyValue(&db2, "key", "2");
+  {
+    auto conn = db1.CreateReadOnlyConn();
+    EXPECT_EQ(conn.Get("key").value_or(""), "2");
+    EXPECT_TRUE(conn.Commit());
+  }
+  db1.RunGc();
+  EXPECT_EQ(db1.GetVersionNum(), 1u);
+
+  // Each database draws the next range once its current one runs out.
+  const std::vector<TxnId> expected_range_begins = {1, 3, 5, 7, 9};
+  EXPECT_TRUE(oracle->range_begins == expected_range_begins);
+}
+
+// Testing senario: while a range is fetched from a slow timestamp oracle,
+// transactions beginning wait for it, but others keep finishing and reading.
+void TestSlowTimestampOracle() {
+  // Blocks fetches once armed, until released.
+  class BlockingOracle : public CounterTimestampOracle {
+   public:
+    TxnId AllocateRange(uint64_t num) override {
+      std::unique_lock lck(mutex);
+      if (armed) {
+        fetching = true;
+        cv.notify_all();
+        cv.wait(lck, [this]() { return released; });
+      }
+      return CounterTimestampOracle::AllocateRange(num);
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool armed = false;
+    bool fetching = false;
+    bool released = false;
+  };
+
+  auto oracle = std::make_shared<BlockingOracle>();
+  Database db{};
+  db.SetTimestampOracle(oracle, /*batch_size=*/1);
+  auto writer = db.CreateConn();
+  writer.Set("key", "val");
+  {
+    std::lock_guard lck(oracle->mutex);
+    oracle->armed = true;
+  }
+  std::thread beginner([&db]() {
+    auto conn = db.CreateConn();
+    EXPECT_EQ(conn.Get("key").value_or(""), "val");
+    EXPECT_TRUE(conn.Commit());
+  });
+  {
+    std::unique_lock lck(oracle->mutex);
+    oracle->cv.wait(lck, [&oracle]() { return oracle->fetching; });
+  }
+
+  EXPECT_TRUE(writer.Commit());
+  {
+    auto reader = db.CreateReadOnlyConn();
+    EXPECT_EQ(reader.Get("key").value_or(""), "val");
+    EXPECT_TRUE(reader.Commit());
+  }
+  {
+    std::lock_guard lck(oracle->mutex);
+    oracle->released = true;
+  }
+  oracle->cv.notify_all();
+  beginner.join();
+}
+
+// Testing senario: transactions beyond the maximum txn id could still read
+// committed data, but their writes and commits fail.
+void TestTxnIdExhaustion() {
+  // Hands out ids from right below the maximum txn id.
+  class NearMaxOracle : public TimestampOracle {
+   public:
+    TxnId AllocateRange(uint64_t num) override {
+      const TxnId range_begin = next_txn_id_;
+      next_txn_id_ += num;
+      return range_begin;
+    }
+
+   private:
+    TxnId next_txn_id_ = kMaxTxnId - 1;
+  };
+
+  Database db{};
+  db.SetTimestampOracle(std::make_shared<NearMaxOracle>(), /*batch_size=*/4);
+  for (const auto* value : {"val-0", "val-1"}) {
+    auto conn = db.CreateConn();
+    EXPECT_TRUE(conn.Set("key", value));
+    EXPECT_TRUE(conn.Commit());
+  }
+  EXPECT_EQ(db.GetNextTxnId(), kMaxTxnId + 1);
+  AssertHasKeyValue(&db, "key", "val-1");
+
+  {
+    auto conn = db.CreateConn(IsolationLevel::kSerializableIsolation);
+    EXPECT_EQ(conn.Get("key").value_or(""), "val-1");
+    EXPECT_FALSE(conn.Set("key", "val-2"));
+    EXPECT_FALSE(conn.Delete("key"));
+    EXPECT_FALSE(conn.Commit());
+  }
+  {
+    auto conn = db.CreateConn();
+    EXPECT_FALSE(conn.Get("other").has_value());
+    EXPECT_FALSE(conn.Commit());
+  }
+  // Read-only connections take no txn id.
+  {
+    auto conn = db.CreateReadOnlyConn();
+    EXPECT_EQ(conn.Get("key").value_or(""), "val-1");
+    EXPECT_TRUE(conn.Commit());
+  }
+  db.RunGc();
+  EXPECT_EQ(db.GetVersionNum(), 1u);
+}
+
+// Testing senario: historical snapshots see the data as of a past txn id
+// within retention, while GC keeps pruning history beyond it.
+void TestHistoricalReads() {
+  Database db{};
+  db.SetHistoryRetention(100);
+  db.SetGcInterval(1);
+  std::vector<TxnId> as_ofs;
+  for (int idx = 0; idx < 3; ++idx) {
+    auto conn = db.CreateConn();
+    conn.Set("key", "val-" + std::to_string(idx));
+    EXPECT_TRUE(conn.Commit());
+    as_ofs.emplace_back(db.GetNextTxnId());
+  }
+  {
+    auto conn = db.CreateConn();
+    EXPECT_TRUE(conn.Delete("key"));
+    EXPECT_TRUE(conn.Commit());
+  }
+  db.RunGc();
+
+  for (int idx = 0; idx < 3; ++idx) {
+    auto conn = db.CreateConnAsOf(as_ofs[idx]);
+    EXPECT_TRUE(conn.has_value());
+    EXPECT_EQ(conn->Get("key").value_or(""), "val-" + std::to_string(idx));
+    EXPECT_TRUE(conn->Commit());
+  }
+  {
+    auto conn = db.CreateConnAsOf(db.GetNextTxnId());
+    EXPECT_FALSE(conn->Get("key").has_value());
+    EXPECT_TRUE(conn->Commit());
+  }
+  EXPECT_FALSE(db.CreateConnAsOf(db.GetNextTxnId() + 1).has_value());
+  EXPECT_FALSE(db.CreateConnAsOf(kInvalidTxnId).has_value());
+
+  // Transactions in progress are excluded, even once they commit.
+  auto writer = db.CreateConn();
+  writer.Set("key", "in-progress");
+  auto conn = db.CreateConnAsOf(db.GetNextTxnId());
+  EXPECT_TRUE(writer.Commit());
+  EXPECT_FALSE(conn->Get("key").has_value());
+
+  // The same goes for snapshots as of the same txn id taken afterwards, even
+  // with later transactions committed since.
+  auto other_writer = db.CreateConn();
+  other_writer.Set("key", "other-in-progress");
+  const TxnId in_flight_as_of = db.GetNextTxnId();
+  {
+    auto before = db.CreateConnAsOf(in_flight_as_of);
+    EXPECT_EQ(before->Get("key").value_or(""), "in-progress");
+    EXPECT_TRUE(before->Commit());
+  }
+  EXPECT_TRUE(other_writer.Commit());
+  {
+    auto updater = db.CreateConn();
+    updater.Set("other-key", "val");
+    EXPECT_TRUE(updater.Commit());
+  }
+  db.RunGc();
+  {
+    auto after = db.CreateConnAsOf(in_flight_as_of);
+    EXPECT_TRUE(after.has_value());
+    EXPECT_EQ(after->Get("key").value_or(""), "in-progress");
+    EXPECT_FALSE(after->Get("other-key").has_value());
+    EXPECT_TRUE(after->Commit());
+  }
+  {
+    auto latest = db.CreateConnAsOf(db.GetNextTxnId());
+    EXPECT_EQ(latest->Get("key").value_or(""), "other-in-progress");
+    EXPECT_TRUE(latest->Commit());
+  }
+
+  // Open historical snapshots hold off GC, while others beyond retention
+  // are rejected.
+  for (int idx = 0; idx < 200; ++idx) {
+    auto updater = db.CreateConn();
+    updater.Set("key", "new-val");
+    EXPECT_TRUE(updater.Commit());
+  }
+  db.RunGc();
+  EXPECT_FALSE(conn->Get("key").has_value());
+  EXPECT_TRUE(conn->Commit());
+  EXPECT_FALSE(db.CreateConnAsOf(as_ofs[0]).has_value());
+  auto recent = db.CreateConnAsOf(db.GetNextTxnId() - 50);
+  EXPECT_TRUE(recent.has_value());
+  EXPECT_EQ(recent->Get("key").value_or(""), "new-val");
+  EXPECT_TRUE(recent->Commit());
+
+  // Without retention, history goes with the last snapshot needing it.
+  Database no_history_db{};
+  const TxnId as_of = no_history_db.GetNextTxnId();
+  {
+    auto conn = no_history_db.CreateConn();
+    conn.Set("key", "val");
+    EXPECT_TRUE(conn.Commit());
+  }
+  no_history_db.RunGc();
+  EXPECT_FALSE(no_history_db.CreateConnAsOf(as_of).has_value());
+}
+
+// Testing senario: statistics count transactions by outcome, and versions
+// scanned by reads.
+void TestStats() {
+  Database db{};
+  db.SetIsolationLevel(IsolationLevel::kSerializableIsolation);
+  db.SetGcInterval(0);
+  {
+    auto conn = db.CreateConn();
+    conn.Set("x", "0");
+    conn.Set("y", "0");
+    EXPECT_TRUE(conn.Commit());
+  }
+  // Write-write conflict.
+  {
+    auto conn1 = db.CreateConn();
+    auto conn2 = db.CreateConn();
+    conn1.Set("x", "1");
+    conn2.Set("x", "2");
+    EXPECT_TRUE(conn1.Commit());
+    EXPECT_FALSE(conn2.Commit());
+  }
+  // Write skew, where at least one of them aborts.
+  uint64_t skew_commit_num = 0;
+  {
+    auto conn1 = db.CreateConn();
+    auto conn2 = db.CreateConn();
+    EXPECT_TRUE(conn1.Get("x").has_value());
+    EXPECT_TRUE(conn2.Get("y").has_value());
+    conn1.Set("y", "1");
+    conn2.Set("x", "1");
+    skew_commit_num += conn1.Commit() ? 1 : 0;
+    skew_commit_num += conn2.Commit() ? 1 : 0;
+    EXPECT_TRUE(skew_commit_num < 2);
+  }
+  // Read-only transaction and user abort.
+  {
+    auto reader = db.CreateReadOnlyConn();
+    EXPECT_TRUE(reader.Get("x").has_value());
+    EXPECT_TRUE(reader.Commit());
+    auto conn = db.CreateConn();
+    conn.Abort();
+  }
+
+  db.RunGc();
+  const auto stats = db.GetStats();
+  EXPECT_EQ(stats.begin_num, 7u);
+  EXPECT_EQ(stats.read_only_begin_num, 1u);
+  EXPECT_EQ(stats.commit_num, 3 + skew_commit_num);
+  EXPECT_EQ(stats.user_abort_num, 1u);
+  EXPECT_EQ(stats.write_conflict_abort_num, 1u);
+  EXPECT_EQ(stats.serialization_abort_num, 2 - skew_commit_num);
+  EXPECT_EQ(stats.read_num, 3u);
+  uint64_t read_num = 0;
+  uint64_t commit_num = 0;
+  uint64_t chain_num = 0;
+  for (size_t idx = 0; idx < DatabaseStats::kHistogramBucketNum; ++idx) {
+    read_num += stats.scanned_version_histogram[idx];
+    commit_num += stats.commit_latency_us_histogram[idx];
+    chain_num += stats.chain_length_histogram[idx];
+  }
+  EXPECT_EQ(read_num, stats.read_num);
+  EXPECT_TRUE(stats.scanned_version_num >= stats.read_num);
+  EXPECT_EQ(commit_num, stats.commit_num);
+  // Both chains are pruned to the latest version.
+  EXPECT_EQ(chain_num, 2u);
+  EXPECT_EQ(stats.chain_length_histogram[DatabaseStats::GetBucket(1)], 2u);
+
+  // Threads alternating between databases count into each one separately.
+  {
+    Database other_db{};
+    for (int idx = 0; idx < 3; ++idx) {
+      auto conn = db.CreateConn();
+      auto other_conn = other_db.CreateConn();
+      EXPECT_TRUE(conn.Commit());
+      EXPECT_TRUE(other_conn.Commit());
+    }
+    EXPECT_EQ(db.GetStats().commit_num, stats.commit_num + 3);
+    EXPECT_EQ(other_db.GetStats().commit_num, 3u);
+  }
+
+  EXPECT_EQ(DatabaseStats::GetBucket(0), 0u);
+  EXPECT_EQ(DatabaseStats::GetBucket(1), 1u);
+  EXPECT_EQ(DatabaseStats::GetBucket(3), 2u);
+  EXPECT_EQ(DatabaseStats::GetBucket(4), 3u);
+  EXPECT_EQ(DatabaseStats::GetBucket(UINT64_MAX),
+            DatabaseStats::kHistogramBucketNum - 1);
 }
 
 }  // namespace mvcc
@@ -247,5 +1467,31 @@ int main(int argc, char** argv) {
   mvcc::TestMultipleTransactions_SerializableIsolation();
   mvcc::TestMultipleTransactions_RepeatableReadIsolation();
   mvcc::TestMultipleTransactions_ReadCommitted();
+  mvcc::TestSnapshot();
+  mvcc::TestCommitLog();
+  mvcc::TestVersionChain();
+  mvcc::TestAbortCompaction();
+  mvcc::TestVersionPool();
+  mvcc::TestPackedValue();
+  mvcc::TestGetView();
+  mvcc::TestMultiGetAndWriteBatch();
+  mvcc::TestReadOnlyTransactions();
+  mvcc::TestFirstCommitterWins();
+  mvcc::TestSerializableSnapshotIsolation_CommittedPivot();
+  mvcc::TestConcurrentTransactions(mvcc::IsolationLevel::kSnapshotIsolation);
+  mvcc::TestConcurrentTransactions(
+      mvcc::IsolationLevel::kSerializableIsolation);
+  mvcc::TestGarbageCollection();
+  mvcc::TestScan();
+  mvcc::TestSerializablePhantom();
+  mvcc::TestRangeFingerprint();
+  mvcc::TestSerializableInternedKeys();
+  mvcc::TestMixedIsolationLevels();
+  mvcc::TestEagerWriteConflict();
+  mvcc::TestTimestampOracle();
+  mvcc::TestSlowTimestampOracle();
+  mvcc::TestTxnIdExhaustion();
+  mvcc::TestHistoricalReads();
+  mvcc::TestStats();
   return 0;
 }
@@ -0,0 +1,161 @@
+#include "partitioned.h"
+
+#include <cassert>
+#include <functional>
+#include <mutex>
+#include <utility>
+
+namespace mvcc {
+
+PartitionedConnection::PartitionedConnection(PartitionedDatabase* db,
+                                             size_t partition_idx)
+    : db_(db), partition_idx_(partition_idx) {}
+
+Connection* PartitionedConnection::GetConn(std::string_view key) {
+  const size_t partition_idx = db_->GetPartitionIndex(key);
+  if (partition_idx_ != kAllPartitions) {
+    assert(partition_idx == partition_idx_);
+    return &conns_[0];
+  }
+  return &conns_[partition_idx];
+}
+
+std::optional<ValueType> PartitionedConnection::Get(std::string_view key) {
+  return GetConn(key)->Get(key);
+}
+
+bool PartitionedConnection::Set(KeyType key, ValueType value) {
+  if (rejected_) {
+    return false;
+  }
+  auto* conn = GetConn(key);
+  written_[conn - conns_.data()] = true;
+  return conn->Set(std::move(key), std::move(value));
+}
+
+bool PartitionedConnection::Delete(std::string_view key) {
+  if (rejected_) {
+    return false;
+  }
+  auto* conn = GetConn(key);
+  written_[conn - conns_.data()] = true;
+  return conn->Delete(key);
+}
+
+bool PartitionedConnection::Commit() {
+  if (rejected_) {
+    Abort();
+    return false;
+  }
+  // Read-only partitions go first, which could only fail under serializable
+  // isolation, before any write becomes visible.
+  std::vector<size_t> written_idxs;
+  for (size_t idx = 0; idx < conns_.size(); ++idx) {
+    if (written_[idx]) {
+      written_idxs.emplace_back(idx);
+    } else if (!conns_[idx].Commit()) {
+      // In-progress connections abort on destruction.
+      conns_.clear();
+      return false;
+    }
+  }
+
+  if (written_idxs.empty()) {
+    return true;
+  }
+  // Fast path: single-partition transactions become visible atomically by
+  // themselves. Multi-partition ones always go through the commit barrier,
+  // even with a single written partition, or multi-partition snapshots could
+  // see their writes but miss what they read from other partitions.
+  if (partition_idx_ != kAllPartitions) {
+    return conns_[written_idxs[0]].Commit();
+  }
+
+  // Prepare in partition order, so concurrent preparers never wait for each
+  // other in a cycle.
+  for (const size_t idx : written_idxs) {
+    if (!conns_[idx].Prepare()) {
+      conns_.clear();
+      return false;
+    }
+  }
+  {
+    std::unique_lock lck(db_->commit_mutex_);
+    for (const size_t idx : written_idxs) {
+      conns_[idx].CommitPrepared();
+    }
+  }
+  for (const size_t idx : written_idxs) {
+    conns_[idx].FinishCommit();
+  }
+  return true;
+}
+
+void PartitionedConnection::Abort() {
+  for (auto& conn : conns_) {
+    conn.Abort();
+  }
+}
+
+PartitionedDatabase::PartitionedDatabase(size_t partition_num) {
+  assert(partition_num > 0);
+  partitions_.reserve(partition_num);
+  for (size_t idx = 0; idx < partition_num; ++idx) {
+    partitions_.emplace_back(std::make_unique<Database>());
+  }
+}
+
+size_t PartitionedDatabase::GetPartitionIndex(std::string_view key) const {
+  // Storage shards within each partition are picked by the low bits of the
+  // same hash, so use the high bits here, or a partition only gets a subset
+  // of its shards.
+  const uint64_t hash = std::hash<std::string_view>{}(key);
+  return ((hash * 0x9E3779B97F4A7C15ull) >> 32) % partitions_.size();
+}
+
+PartitionedConnection PartitionedDatabase::CreateSinglePartitionConn(
+    std::string_view key, IsolationLevel isolation_level) {
+  const size_t partition_idx = GetPartitionIndex(key);
+  PartitionedConnection conn(this, partition_idx);
+  conn.conns_.emplace_back(
+      partitions_[partition_idx]->CreateConn(isolation_level));
+  conn.written_.resize(1);
+  return conn;
+}
+
+PartitionedConnection PartitionedDatabase::CreateConn(
+    IsolationLevel isolation_level) {
+  PartitionedConnection conn(this, PartitionedConnection::kAllPartitions);
+  // Prepared serializable transactions hold SSI mutex of their partitions,
+  // which begins take with commit barrier held, so reject them and only read
+  // at snapshot isolation instead.
+  if (isolation_level == IsolationLevel::kSerializableIsolation) {
+    conn.rejected_ = true;
+    isolation_level = IsolationLevel::kSnapshotIsolation;
+  }
+  conn.conns_.reserve(partitions_.size());
+  {
+    std::shared_lock lck(commit_mutex_);
+    for (auto& partition : partitions_) {
+      conn.conns_.emplace_back(partition->CreateConn(isolation_level));
+    }
+  }
+  conn.written_.resize(partitions_.size());
+  return conn;
+}
+
+PartitionedConnection PartitionedDatabase::CreateReadOnlyConn(
+    IsolationLevel isolation_level) {
+  PartitionedConnection conn(this, PartitionedConnection::kAllPartitions);
+  conn.conns_.reserve(partitions_.size());
+  {
+    std::shared_lock lck(commit_mutex_);
+    for (auto& partition : partitions_) {
+      conn.conns_.emplace_back(partition->CreateReadOnlyConn(isolation_level));
+    }
+  }
+  conn.written_.resize(partitions_.size());
+  return conn;
+}
+
+}  // namespace mvcc
@@ -0,0 +1,123 @@
+// Hash-partitioned database, where keys hash to independent [Database]
+// partitions, each with its own storage, active transactions, commit log and
+// GC, so transactions on different partitions share nothing.
+//
+// Single-partition transactions are declared upfront, and run and commit on
+// their partition alone with no cross-partition coordination.
+//
+// Multi-partition transactions take snapshots on all partitions at begin, and
+// commit by two-phase commit: written partitions are prepared in partition
+// order, so concurrent preparers never deadlock, then all become visible with
+// a database-wide commit barrier held. Begins hold the barrier in shared mode,
+// so a snapshot never sees a multi-partition transaction partially, while
+// single-partition ones never touch it.
+//
+// Conflicts are detected within each partition at its isolation level, so
+// serializable isolation is only supported for single-partition transactions
+// and read-only ones.
+//
+// Atomicity across partitions only holds in memory: each partition logs its
+// part of a multi-partition transaction with its own durability policy, and
+// no commit decision is logged across them, so a crash in between could
+// persist the transaction on some partitions but not others.
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <string_view>
+#include <vector>
+
+#include "mvcc.h"
+
+namespace mvcc {
+
+class PartitionedDatabase;
+
+// Transaction on a partitioned database.
+class PartitionedConnection {
+ public:
+  PartitionedConnection(PartitionedConnection&&) noexcept = default;
+  PartitionedConnection& operator=(PartitionedConnection&&) noexcept = default;
+
+  // Same as [Connection]; keys should be within the partition for
+  // single-partition transactions.
+  std::optional<ValueType> Get(std::string_view key);
+  bool Set(KeyType key, ValueType value);
+  bool Delete(std::string_view key);
+
+  // Return whether the transaction commits on all written partitions.
+  bool Commit();
+
+  void Abort();
+
+ private:
+  friend class PartitionedDatabase;
+
+  PartitionedConnection(PartitionedDatabase* db, size_t partition_idx);
+
+  // Get connection on the partition for [key].
+  Connection* GetConn(std::string_view key);
+
+  PartitionedDatabase* db_ = nullptr;
+  // Partition for single-partition transaction, or [kAllPartitions].
+  static constexpr size_t kAllPartitions = SIZE_MAX;
+  size_t partition_idx_ = kAllPartitions;
+  // Connections on all partitions, or the only partition.
+  std::vector<Connection> conns_;
+  // Whether each connection has written.
+  std::vector<bool> written_;
+  // Whether the transaction is rejected at begin, so it could only read, and
+  // its writes and commit fail.
+  bool rejected_ = false;
+};
+
+class PartitionedDatabase {
+ public:
+  explicit PartitionedDatabase(size_t partition_num);
+
+  PartitionedDatabase(const PartitionedDatabase&) = delete;
+  PartitionedDatabase& operator=(const PartitionedDatabase&) = delete;
+
+  size_t GetPartitionNum() const {
+    return partitions_.size();
+  }
+
+  // Get the partition index for [key].
+  size_t GetPartitionIndex(std::string_view key) const;
+
+  // Get partition [partition_idx], eg, for setting its policies before any
+  // connection is created.
+  Database* GetPartition(size_t partition_idx) {
+    return partitions_[partition_idx].get();
+  }
+
+  // Create a transaction which only accesses keys within the partition for
+  // [key].
+  PartitionedConnection CreateSinglePartitionConn(
+      std::string_view key,
+      IsolationLevel isolation_level = IsolationLevel::kSnapshotIsolation);
+
+  // Create a transaction which could access all partitions, at snapshot
+  // isolation or weaker levels. Serializable ones are rejected: they read at
+  // snapshot isolation, but all their writes and commits fail.
+  PartitionedConnection CreateConn(
+      IsolationLevel isolation_level = IsolationLevel::kSnapshotIsolation);
+
+  // Create a read-only transaction which could access all partitions, like
+  // [Database::CreateReadOnlyConn].
+  PartitionedConnection CreateReadOnlyConn(
+      IsolationLevel isolation_level = IsolationLevel::kSnapshotIsolation);
+
+ private:
+  friend class PartitionedConnection;
+
+  std::vector<std::unique_ptr<Database>> partitions_;
+  // Held exclusively while multi-partition transactions become visible, and
+  // in shared mode while multi-partition transactions take snapshots.
+  std::shared_mutex commit_mutex_;
+};
+
+}  // namespace mvcc
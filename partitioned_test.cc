@@ -0,0 +1,250 @@
+#include "partitioned.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "test_utils.h"
+
+namespace mvcc {
+
+// Testing senario: single-partition transactions only touch their partition,
+// and keys spread over all partitions.
+void TestSinglePartition() {
+  PartitionedDatabase db{/*partition_num=*/4};
+  constexpr int kKeyNum = 100;
+  std::vector<size_t> partition_key_nums(db.GetPartitionNum());
+  for (int idx = 0; idx < kKeyNum; ++idx) {
+    const auto key = "key-" + std::to_string(idx);
+    ++partition_key_nums[db.GetPartitionIndex(key)];
+    auto conn = db.CreateSinglePartitionConn(key);
+    EXPECT_TRUE(conn.Set(key, std::to_string(idx)));
+    EXPECT_TRUE(conn.Commit());
+  }
+  for (size_t idx = 0; idx < db.GetPartitionNum(); ++idx) {
+    EXPECT_TRUE(partition_key_nums[idx] > 0);
+  }
+
+  for (int idx = 0; idx < kKeyNum; ++idx) {
+    const auto key = "key-" + std::to_string(idx);
+    AssertHasKeyValue(db.GetPartition(db.GetPartitionIndex(key)), key,
+                      std::to_string(idx));
+    for (size_t partition_idx = 0; partition_idx < db.GetPartitionNum();
+         ++partition_idx) {
+      if (partition_idx == db.GetPartitionIndex(key)) {
+        continue;
+      }
+      auto conn = db.GetPartition(partition_idx)->CreateConn();
+      EXPECT_FALSE(conn.Get(key).has_value());
+      EXPECT_TRUE(conn.Commit());
+    }
+  }
+
+  // Serializable isolation is supported within a partition, but rejected
+  // across partitions.
+  {
+    auto conn = db.CreateConn(IsolationLevel::kSerializableIsolation);
+    EXPECT_EQ(conn.Get("key-0").value_or(""), "0");
+    EXPECT_FALSE(conn.Set("key-1", "rejected"));
+    EXPECT_FALSE(conn.Delete("key-0"));
+    EXPECT_FALSE(conn.Commit());
+  }
+  {
+    auto conn = db.CreateSinglePartitionConn(
+        "key-0", IsolationLevel::kSerializableIsolation);
+    EXPECT_EQ(conn.Get("key-0").value_or(""), "0");
+    EXPECT_TRUE(conn.Delete("key-0"));
+    EXPECT_TRUE(conn.Commit());
+  }
+  auto conn = db.CreateReadOnlyConn();
+  EXPECT_FALSE(conn.Get("key-0").has_value());
+  EXPECT_EQ(conn.Get("key-1").value_or(""), "1");
+  EXPECT_TRUE(conn.Commit());
+}
+
+// Testing senario: conflicting multi-partition transactions leave no partial
+// effects on any partition.
+void TestCrossPartitionConflict() {
+  PartitionedDatabase db{/*partition_num=*/4};
+  // Pick two keys on different partitions.
+  const std::string key1 = "key-0";
+  std::string key2;
+  for (int idx = 1; key2.empty(); ++idx) {
+    const auto key = "key-" + std::to_string(idx);
+    if (db.GetPartitionIndex(key) != db.GetPartitionIndex(key1)) {
+      key2 = key;
+    }
+  }
+
+  auto conn1 = db.CreateConn();
+  auto conn2 = db.CreateConn();
+  EXPECT_TRUE(conn1.Set(key1, "1"));
+  EXPECT_TRUE(conn1.Set(key2, "1"));
+  EXPECT_TRUE(conn2.Set(key2, "2"));
+  EXPECT_TRUE(conn2.Set(key1, "2"));
+  EXPECT_TRUE(conn2.Commit());
+  EXPECT_FALSE(conn1.Commit());
+
+  auto conn = db.CreateReadOnlyConn();
+  EXPECT_EQ(conn.Get(key1).value_or(""), "2");
+  EXPECT_EQ(conn.Get(key2).value_or(""), "2");
+  EXPECT_TRUE(conn.Commit());
+
+  // Abort drops writes on all partitions.
+  {
+    auto conn = db.CreateConn();
+    EXPECT_TRUE(conn.Set(key1, "3"));
+    EXPECT_TRUE(conn.Delete(key2));
+    conn.Abort();
+  }
+  AssertHasKeyValue(db.GetPartition(db.GetPartitionIndex(key1)), key1, "2");
+  AssertHasKeyValue(db.GetPartition(db.GetPartitionIndex(key2)), key2, "2");
+}
+
+// Testing senario: multi-partition snapshots always see a consistent state,
+// while cross-partition transfers and single-partition updates keep
+// committing.
+void TestCrossPartitionAtomicity() {
+  PartitionedDatabase db{/*partition_num=*/4};
+  constexpr int kAccountNum = 16;
+  constexpr int kBalance = 100;
+  {
+    auto conn = db.CreateConn();
+    for (int idx = 0; idx < kAccountNum; ++idx) {
+      EXPECT_TRUE(
+          conn.Set("account-" + std::to_string(idx), std::to_string(kBalance)));
+    }
+    EXPECT_TRUE(conn.Commit());
+  }
+
+  constexpr int kThreadNum = 4;
+  constexpr int kTransferNum = 500;
+  std::atomic<int> finished_thread_num{0};
+  std::vector<std::thread> threads;
+  for (int thd_idx = 0; thd_idx < kThreadNum; ++thd_idx) {
+    threads.emplace_back([&, thd_idx]() {
+      for (int idx = 0; idx < kTransferNum; ++idx) {
+        const auto from = "account-" + std::to_string(idx % kAccountNum);
+        const auto to =
+            "account-" + std::to_string((idx + thd_idx + 1) % kAccountNum);
+        if (from == to) {
+          continue;
+        }
+        // Unrelated single-partition updates run alongside.
+        const auto other = "other-" + std::to_string(thd_idx);
+        {
+          auto conn = db.CreateSinglePartitionConn(other);
+          conn.Set(other, std::to_string(idx));
+          conn.Commit();
+        }
+        auto conn = db.CreateConn();
+        const int from_balance = std::stoi(conn.Get(from).value_or("0"));
+        const int to_balance = std::stoi(conn.Get(to).value_or("0"));
+        if (!conn.Set(from, std::to_string(from_balance - 1))
+            || !conn.Set(to, std::to_string(to_balance + 1))) {
+          conn.Abort();
+          continue;
+        }
+        conn.Commit();
+      }
+      ++finished_thread_num;
+    });
+  }
+
+  const auto check_total = [&]() {
+    auto conn = db.CreateReadOnlyConn();
+    int total = 0;
+    for (int idx = 0; idx < kAccountNum; ++idx) {
+      total +=
+          std::stoi(conn.Get("account-" + std::to_string(idx)).value_or("0"));
+    }
+    EXPECT_EQ(total, kAccountNum * kBalance);
+    EXPECT_TRUE(conn.Commit());
+  };
+  while (finished_thread_num < kThreadNum) {
+    check_total();
+  }
+  for (auto& thd : threads) {
+    thd.join();
+  }
+  check_total();
+}
+
+// Testing senario: multi-partition transactions writing a single partition
+// copy what they read from another partition, multi-partition snapshots never
+// see a copy newer than its source.
+void TestCrossPartitionReadSkew() {
+  PartitionedDatabase db{/*partition_num=*/4};
+  // Pick the source on a lower partition, which snapshots take first, so a
+  // copy committed while a snapshot is being taken shows up.
+  std::string source;
+  std::string copy;
+  for (int idx = 0; copy.empty(); ++idx) {
+    const auto key = "key-" + std::to_string(idx);
+    if (source.empty() && db.GetPartitionIndex(key) == 0) {
+      source = key;
+    } else if (db.GetPartitionIndex(key) != 0) {
+      copy = key;
+    }
+  }
+  {
+    auto conn = db.CreateConn();
+    EXPECT_TRUE(conn.Set(source, "0"));
+    EXPECT_TRUE(conn.Set(copy, "0"));
+    EXPECT_TRUE(conn.Commit());
+  }
+
+  constexpr int kUpdateNum = 5000;
+  constexpr int kCopierNum = 2;
+  constexpr int kReaderNum = 2;
+  std::atomic<bool> finished{false};
+  std::vector<std::thread> threads;
+  // Single-partition increments on the source.
+  threads.emplace_back([&]() {
+    for (int idx = 1; idx <= kUpdateNum; ++idx) {
+      auto conn = db.CreateSinglePartitionConn(source);
+      EXPECT_TRUE(conn.Set(source, std::to_string(idx)));
+      EXPECT_TRUE(conn.Commit());
+    }
+    finished = true;
+  });
+  for (int thd_idx = 0; thd_idx < kCopierNum; ++thd_idx) {
+    threads.emplace_back([&]() {
+      while (!finished) {
+        auto conn = db.CreateConn();
+        const auto value = conn.Get(source);
+        EXPECT_TRUE(value.has_value());
+        if (!conn.Set(copy, *value)) {
+          conn.Abort();
+          continue;
+        }
+        conn.Commit();
+      }
+    });
+  }
+  for (int thd_idx = 0; thd_idx < kReaderNum; ++thd_idx) {
+    threads.emplace_back([&]() {
+      while (!finished) {
+        auto conn = db.CreateReadOnlyConn();
+        const int copy_value = std::stoi(conn.Get(copy).value_or(""));
+        const int source_value = std::stoi(conn.Get(source).value_or(""));
+        EXPECT_TRUE(copy_value <= source_value);
+        EXPECT_TRUE(conn.Commit());
+      }
+    });
+  }
+  for (auto& thd : threads) {
+    thd.join();
+  }
+}
+
+}  // namespace mvcc
+
+int main(int argc, char** argv) {
+  mvcc::TestSinglePartition();
+  mvcc::TestCrossPartitionConflict();
+  mvcc::TestCrossPartitionAtomicity();
+  mvcc::TestCrossPartitionReadSkew();
+  return 0;
+}
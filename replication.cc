@@ -0,0 +1,179 @@
+#include "replication.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace mvcc {
+
+ReplicationLog::ReplicationLog(std::unique_ptr<DurabilityPolicy> inner)
+    : inner_(std::move(inner)) {}
+
+uint64_t ReplicationLog::Append(TxnId txn_id,
+                                const std::vector<WriteRecord>& writes) {
+  // Copy and log outside of the critical section.
+  auto record = std::make_shared<Record>();
+  record->txn_id = txn_id;
+  record->writes = writes;
+  if (inner_ != nullptr) {
+    record->lsn = inner_->Append(txn_id, writes);
+  }
+
+  std::lock_guard lck(mutex_);
+  record->seq = ++appended_seq_;
+  const uint64_t lsn = inner_ != nullptr ? record->lsn : record->seq;
+  records_.emplace_back(std::move(record));
+  // Nothing to wait for without inner policy.
+  if (inner_ == nullptr) {
+    shipped_seq_ = appended_seq_;
+    TrimRecords();
+  }
+  return lsn;
+}
+
+void ReplicationLog::WaitDurable(uint64_t lsn) {
+  if (inner_ == nullptr) {
+    return;
+  }
+  inner_->WaitDurable(lsn);
+  ShipDurable(lsn);
+}
+
+void ReplicationLog::OnDurable(uint64_t lsn, std::function<void()> callback) {
+  if (inner_ == nullptr) {
+    callback();
+    return;
+  }
+  inner_->OnDurable(lsn, [this, lsn, callback = std::move(callback)]() {
+    ShipDurable(lsn);
+    callback();
+  });
+}
+
+void ReplicationLog::ShipDurable(uint64_t lsn) {
+  // Records are logged by inner policy in a slightly different order for
+  // concurrent non-conflicting transactions, so only ship the prefix which
+  // is all durable.
+  std::lock_guard lck(mutex_);
+  durable_lsn_ = std::max(durable_lsn_, lsn);
+  const uint64_t first_seq = records_.empty() ? 0 : records_.front()->seq;
+  while (shipped_seq_ < appended_seq_
+         && records_[shipped_seq_ + 1 - first_seq]->lsn <= durable_lsn_) {
+    ++shipped_seq_;
+  }
+  TrimRecords();
+}
+
+uint64_t ReplicationLog::GetAppendedLsn() {
+  if (inner_ != nullptr) {
+    return inner_->GetAppendedLsn();
+  }
+  std::lock_guard lck(mutex_);
+  return appended_seq_;
+}
+
+std::vector<std::shared_ptr<const ReplicationLog::Record>>
+ReplicationLog::Read(uint64_t seq, size_t max_num) {
+  std::vector<std::shared_ptr<const Record>> records;
+  std::lock_guard lck(mutex_);
+  if (records_.empty() || seq >= shipped_seq_) {
+    return records;
+  }
+  const uint64_t first_seq = records_.front()->seq;
+  for (uint64_t cur_seq = std::max(seq + 1, first_seq);
+       cur_seq <= shipped_seq_ && records.size() < max_num; ++cur_seq) {
+    records.emplace_back(records_[cur_seq - first_seq]);
+  }
+  return records;
+}
+
+uint64_t ReplicationLog::GetShippedSeq() {
+  std::lock_guard lck(mutex_);
+  return shipped_seq_;
+}
+
+uint64_t ReplicationLog::AddFollower(uint64_t seq) {
+  std::lock_guard lck(mutex_);
+  const uint64_t follower_id = next_follower_id_++;
+  follower_seqs_.emplace(follower_id, seq);
+  return follower_id;
+}
+
+void ReplicationLog::UpdateFollower(uint64_t follower_id, uint64_t seq) {
+  std::lock_guard lck(mutex_);
+  follower_seqs_[follower_id] = seq;
+  TrimRecords();
+}
+
+void ReplicationLog::RemoveFollower(uint64_t follower_id) {
+  std::lock_guard lck(mutex_);
+  follower_seqs_.erase(follower_id);
+  TrimRecords();
+}
+
+void ReplicationLog::TrimRecords() {
+  uint64_t trim_seq = shipped_seq_;
+  for (const auto& [_, seq] : follower_seqs_) {
+    trim_seq = std::min(trim_seq, seq);
+  }
+  while (!records_.empty() && records_.front()->seq <= trim_seq) {
+    records_.pop_front();
+  }
+}
+
+Replica::Replica(ReplicationLog* log, Database* db)
+    : log_(log), db_(db), follower_id_(log->AddFollower(0)) {}
+
+Replica::~Replica() {
+  log_->RemoveFollower(follower_id_);
+}
+
+size_t Replica::CatchUp(size_t max_num) {
+  std::lock_guard lck(apply_mutex_);
+  size_t applied_num = 0;
+  while (applied_num < max_num) {
+    const auto records = log_->Read(
+        applied_seq_, std::min(max_num - applied_num, kReadBatchSize));
+    if (records.empty()) {
+      break;
+    }
+    for (const auto& record : records) {
+      // Records are applied by a single writer, so they never conflict.
+      auto conn = db_->CreateConn(IsolationLevel::kSnapshotIsolation);
+      for (const auto& write : record->writes) {
+        if (write.is_deleted) {
+          conn.Delete(write.key);
+        } else {
+          conn.Set(write.key, write.value);
+        }
+      }
+      conn.Commit();
+      applied_seq_ = record->seq;
+    }
+    applied_num += records.size();
+    log_->UpdateFollower(follower_id_, applied_seq_);
+  }
+  return applied_num;
+}
+
+uint64_t Replica::GetAppliedSeq() {
+  return applied_seq_;
+}
+
+uint64_t Replica::GetLag() {
+  const uint64_t applied_seq = applied_seq_;
+  const uint64_t shipped_seq = log_->GetShippedSeq();
+  return shipped_seq > applied_seq ? shipped_seq - applied_seq : 0;
+}
+
+Connection Replica::CreateReadOnlyConn(uint64_t max_lag) {
+  // Only catch up with records shipped by now, or a primary shipping faster
+  // than follower applies could keep the reader waiting forever.
+  const uint64_t shipped_seq = log_->GetShippedSeq();
+  for (uint64_t applied_seq = applied_seq_; applied_seq + max_lag < shipped_seq;
+       applied_seq = applied_seq_) {
+    CatchUp(shipped_seq - max_lag - applied_seq);
+  }
+  return db_->CreateReadOnlyConn(IsolationLevel::kSnapshotIsolation);
+}
+
+}  // namespace mvcc
@@ -0,0 +1,145 @@
+// Log-shipping replication for [Database], so read-only traffic could be
+// served by followers instead of the primary.
+//
+// Primary sets a [ReplicationLog] as its durability policy, which keeps
+// committed write sets in memory in the order they're logged, optionally
+// forwarding them to another policy (eg, write-ahead log) to persist. Records
+// are appended before transactions become visible, under the latches of all
+// written chains, so conflicting transactions are shipped in commit order.
+//
+// Each [Replica] applies shipped records into its own follower database one
+// transaction at a time in log order, so a snapshot on follower always sees a
+// prefix of the log. Reads on follower are read-only connections with
+// bounded staleness, in terms of records shipped but not applied yet.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "mvcc.h"
+
+namespace mvcc {
+
+class ReplicationLog : public DurabilityPolicy {
+ public:
+  // Committed write set of one transaction.
+  struct Record {
+    // Sequence number in replication log, starting from 1.
+    uint64_t seq = 0;
+    // Log sequence number from inner policy, 0 if there's none.
+    uint64_t lsn = 0;
+    TxnId txn_id = kInvalidTxnId;
+    std::vector<WriteRecord> writes;
+  };
+
+  // Records are only shipped once [inner] policy has made them durable, if
+  // any, so followers never see transactions primary could lose on crash.
+  explicit ReplicationLog(std::unique_ptr<DurabilityPolicy> inner = nullptr);
+
+  ReplicationLog(const ReplicationLog&) = delete;
+  ReplicationLog& operator=(const ReplicationLog&) = delete;
+
+  // Log sequence number comes from inner policy, or is the replication
+  // sequence number if there's none.
+  uint64_t Append(TxnId txn_id,
+                  const std::vector<WriteRecord>& writes) override;
+
+  void WaitDurable(uint64_t lsn) override;
+
+  // Callbacks run once inner policy has made [lsn] durable, after records up
+  // to it get shipped.
+  void OnDurable(uint64_t lsn, std::function<void()> callback) override;
+
+  uint64_t GetAppendedLsn() override;
+
+  // Get up to [max_num] shipped records after sequence number [seq], in log
+  // order.
+  std::vector<std::shared_ptr<const Record>> Read(uint64_t seq,
+                                                  size_t max_num);
+
+  // Get the sequence number of the last shipped record.
+  uint64_t GetShippedSeq();
+
+  // Register a follower which has applied records up to [seq], return its id
+  // for [UpdateFollower]. Records applied by all followers are dropped, so
+  // followers should be registered before records they need are dropped.
+  uint64_t AddFollower(uint64_t seq);
+
+  // Update the sequence number follower [follower_id] has applied up to.
+  void UpdateFollower(uint64_t follower_id, uint64_t seq);
+
+  // Unregister follower [follower_id].
+  void RemoveFollower(uint64_t follower_id);
+
+ private:
+  // Ship the prefix of records known to be durable, [lsn] being durable in
+  // inner policy.
+  void ShipDurable(uint64_t lsn);
+
+  // Drop records applied by all followers, or all shipped ones if there're no
+  // followers. [mutex_] should be held by caller.
+  void TrimRecords();
+
+  const std::unique_ptr<DurabilityPolicy> inner_;
+
+  std::mutex mutex_;
+  // Records not dropped yet, in log order.
+  std::deque<std::shared_ptr<const Record>> records_;
+  // Sequence number of the last appended record.
+  uint64_t appended_seq_ = 0;
+  // Sequence number of the last shipped record.
+  uint64_t shipped_seq_ = 0;
+  // Log sequence number of inner policy known to be durable.
+  uint64_t durable_lsn_ = 0;
+  // Applied sequence number for each registered follower.
+  std::map<uint64_t, uint64_t> follower_seqs_;
+  uint64_t next_follower_id_ = 0;
+};
+
+class Replica {
+ public:
+  // Follow [log] into [db], which should be empty and not written otherwise;
+  // both should outlive the replica.
+  Replica(ReplicationLog* log, Database* db);
+
+  Replica(const Replica&) = delete;
+  Replica& operator=(const Replica&) = delete;
+
+  ~Replica();
+
+  // Apply up to [max_num] shipped records not applied yet, return the number
+  // of applied ones.
+  size_t CatchUp(size_t max_num = SIZE_MAX);
+
+  // Get the sequence number of the last applied record.
+  uint64_t GetAppliedSeq();
+
+  // Get the number of records shipped but not applied yet.
+  uint64_t GetLag();
+
+  // Create a read-only connection on follower, catching up first if it lags
+  // behind records shipped by the call by more than [max_lag] ones; 0 means
+  // reading at least all records shipped by then.
+  Connection CreateReadOnlyConn(uint64_t max_lag = 0);
+
+ private:
+  // Number of records fetched from replication log at a time.
+  static constexpr size_t kReadBatchSize = 256;
+
+  ReplicationLog* const log_;
+  Database* const db_;
+  const uint64_t follower_id_;
+
+  // Serializes appliers, so records are applied in log order.
+  std::mutex apply_mutex_;
+  std::atomic<uint64_t> applied_seq_{0};
+};
+
+}  // namespace mvcc
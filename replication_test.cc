@@ -0,0 +1,214 @@
+#include "replication.h"
+
+#include <unistd.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "test_utils.h"
+#include "wal.h"
+
+namespace mvcc {
+
+// Testing senario: followers serve snapshot reads at the replicated position,
+// and only catch up as much as the staleness bound requires.
+void TestReplicaReads() {
+  Database primary{};
+  auto log_ptr = std::make_unique<ReplicationLog>();
+  auto* log = log_ptr.get();
+  primary.SetDurabilityPolicy(std::move(log_ptr));
+  Database follower1{};
+  Database follower2{};
+  Replica replica1(log, &follower1);
+  Replica replica2(log, &follower2);
+
+  for (int idx = 0; idx < 10; ++idx) {
+    auto conn = primary.CreateConn();
+    conn.Set("key-" + std::to_string(idx), std::to_string(idx));
+    EXPECT_TRUE(conn.Commit());
+  }
+  {
+    auto conn = primary.CreateConn();
+    EXPECT_TRUE(conn.Delete("key-0"));
+    EXPECT_TRUE(conn.Commit());
+  }
+  EXPECT_EQ(replica1.GetLag(), 11u);
+
+  // Stale reads within the bound apply nothing, otherwise catch up.
+  {
+    auto conn = replica1.CreateReadOnlyConn(/*max_lag=*/11);
+    EXPECT_FALSE(conn.Get("key-1").has_value());
+    EXPECT_TRUE(conn.Commit());
+  }
+  EXPECT_EQ(replica1.CatchUp(/*max_num=*/5), 5u);
+  {
+    auto conn = replica1.CreateReadOnlyConn(/*max_lag=*/6);
+    EXPECT_EQ(conn.Get("key-4").value_or(""), "4");
+    EXPECT_FALSE(conn.Get("key-5").has_value());
+    EXPECT_TRUE(conn.Commit());
+  }
+  {
+    auto conn = replica1.CreateReadOnlyConn();
+    EXPECT_EQ(replica1.GetLag(), 0u);
+    EXPECT_EQ(replica1.GetAppliedSeq(), 11u);
+    EXPECT_FALSE(conn.Get("key-0").has_value());
+    size_t key_num = 0;
+    for (auto iter = conn.Scan("key-", "key."); iter.Valid(); iter.Next()) {
+      EXPECT_EQ(iter.key(), "key-" + iter.value());
+      ++key_num;
+    }
+    EXPECT_EQ(key_num, 9u);
+    EXPECT_TRUE(conn.Commit());
+  }
+
+  // Records are kept until all followers have applied them.
+  EXPECT_EQ(log->Read(0, SIZE_MAX).size(), 11u);
+  EXPECT_EQ(replica2.CatchUp(), 11u);
+  EXPECT_TRUE(log->Read(0, SIZE_MAX).empty());
+  AssertHasKeyValue(&follower2, "key-9", "9");
+}
+
+// Testing senario: follower ends up with what primary readers see, even if
+// concurrent writers of a key commit in the reverse order of writing.
+void TestReplicaReverseCommitOrder() {
+  for (const auto isolation_level :
+       {IsolationLevel::kReadCommittedIsolation,
+        IsolationLevel::kRepeatableReadIsolation}) {
+    Database primary{};
+    auto log_ptr = std::make_unique<ReplicationLog>();
+    auto* log = log_ptr.get();
+    primary.SetDurabilityPolicy(std::move(log_ptr));
+    Database follower{};
+    Replica replica(log, &follower);
+
+    auto first = primary.CreateConn(isolation_level);
+    auto second = primary.CreateConn(isolation_level);
+    EXPECT_TRUE(first.Set("key", "a"));
+    EXPECT_TRUE(second.Set("key", "b"));
+    EXPECT_TRUE(second.Commit());
+    EXPECT_TRUE(first.Commit());
+    AssertHasKeyValue(&primary, "key", "a");
+    auto reader = replica.CreateReadOnlyConn();
+    EXPECT_EQ(reader.Get("key").value_or(""), "a");
+    EXPECT_TRUE(reader.Commit());
+  }
+}
+
+// Testing senario: records are only shipped once durable in the inner log,
+// which keeps its own log sequence numbers.
+void TestReplicationWithWal() {
+  const auto wal_path = GetTestTmpPath("replication_test.log");
+  unlink(wal_path.c_str());
+  {
+    Database primary{};
+    auto log_ptr = std::make_unique<ReplicationLog>(
+        WriteAheadLog::Open(wal_path));
+    auto* log = log_ptr.get();
+    primary.SetDurabilityPolicy(std::move(log_ptr));
+    Database follower{};
+    Replica replica(log, &follower);
+
+    auto conn = primary.CreateConn();
+    conn.Set("key", "val");
+    EXPECT_TRUE(conn.Commit());
+    EXPECT_EQ(log->GetShippedSeq(), 1u);
+    EXPECT_TRUE(log->GetAppendedLsn() > 1);
+    auto reader = replica.CreateReadOnlyConn();
+    EXPECT_EQ(reader.Get("key").value_or(""), "val");
+  }
+
+  Database recovered{};
+  EXPECT_TRUE(ReplayWal(wal_path, &recovered));
+  AssertHasKeyValue(&recovered, "key", "val");
+}
+
+// Testing senario: follower snapshots always see a consistent state, while
+// transfers keep committing on primary.
+void TestReplicaConsistency() {
+  Database primary{};
+  auto log_ptr = std::make_unique<ReplicationLog>();
+  auto* log = log_ptr.get();
+  primary.SetDurabilityPolicy(std::move(log_ptr));
+  Database follower{};
+  Replica replica(log, &follower);
+
+  constexpr int kAccountNum = 4;
+  constexpr int kBalance = 100;
+  {
+    auto conn = primary.CreateConn();
+    for (int idx = 0; idx < kAccountNum; ++idx) {
+      conn.Set("account-" + std::to_string(idx), std::to_string(kBalance));
+    }
+    EXPECT_TRUE(conn.Commit());
+  }
+  replica.CatchUp();
+
+  constexpr int kThreadNum = 4;
+  constexpr int kTransferNum = 500;
+  std::atomic<int> finished_thread_num{0};
+  std::vector<std::thread> threads;
+  for (int thd_idx = 0; thd_idx < kThreadNum; ++thd_idx) {
+    threads.emplace_back([&, thd_idx]() {
+      for (int idx = 0; idx < kTransferNum; ++idx) {
+        const auto from = "account-" + std::to_string(idx % kAccountNum);
+        const auto to =
+            "account-" + std::to_string((idx + thd_idx + 1) % kAccountNum);
+        if (from == to) {
+          continue;
+        }
+        auto conn = primary.CreateConn();
+        const int from_balance = std::stoi(*conn.Get(from));
+        const int to_balance = std::stoi(*conn.Get(to));
+        conn.Set(from, std::to_string(from_balance - 1));
+        conn.Set(to, std::to_string(to_balance + 1));
+        conn.Commit();
+      }
+      ++finished_thread_num;
+    });
+  }
+
+  // Fresh reads only wait for records shipped before they start.
+  for (int idx = 0; idx < 10; ++idx) {
+    const uint64_t shipped_seq = log->GetShippedSeq();
+    auto conn = replica.CreateReadOnlyConn();
+    EXPECT_TRUE(replica.GetAppliedSeq() >= shipped_seq);
+    EXPECT_TRUE(conn.Commit());
+  }
+
+  const auto check_total = [&]() {
+    auto conn = replica.CreateReadOnlyConn(/*max_lag=*/16);
+    int total = 0;
+    for (int idx = 0; idx < kAccountNum; ++idx) {
+      total += std::stoi(*conn.Get("account-" + std::to_string(idx)));
+    }
+    EXPECT_EQ(total, kAccountNum * kBalance);
+    EXPECT_TRUE(conn.Commit());
+  };
+  while (finished_thread_num < kThreadNum) {
+    check_total();
+  }
+  for (auto& thd : threads) {
+    thd.join();
+  }
+  check_total();
+
+  replica.CatchUp();
+  for (int idx = 0; idx < kAccountNum; ++idx) {
+    const auto key = "account-" + std::to_string(idx);
+    auto conn = primary.CreateConn();
+    AssertHasKeyValue(&follower, key, *conn.Get(key));
+  }
+}
+
+}  // namespace mvcc
+
+int main(int argc, char** argv) {
+  mvcc::TestReplicaReads();
+  mvcc::TestReplicaReverseCommitOrder();
+  mvcc::TestReplicationWithWal();
+  mvcc::TestReplicaConsistency();
+  return 0;
+}
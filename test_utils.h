@@ -0,0 +1,51 @@
+// Assertion utilities shared by tests.
+//
+// TODO(hjiang): Use `googletest` instead of `assert`.
+
+#pragma once
+
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "mvcc.h"
+
+namespace mvcc {
+
+template <typename T1, typename T2>
+bool CheckEqualityAndLog(const T1& lhs, const T2& rhs) {
+  if (lhs == rhs) {
+    return true;
+  }
+  std::cerr << "lhs: " << lhs << ", rhs: " << rhs << std::endl;
+  return false;
+}
+
+}  // namespace mvcc
+
+#define EXPECT_EQ(lhs, rhs)                             \
+  if (const auto& lhs_value = (lhs); true)              \
+    if (const auto& rhs_value = (rhs); true)            \
+      assert(::mvcc::CheckEqualityAndLog(lhs_value, rhs_value))
+
+#define EXPECT_TRUE(cond) assert((cond))
+#define EXPECT_FALSE(cond) assert(!(cond))
+
+namespace mvcc {
+
+inline void AssertHasKeyValue(Database* db, const KeyType& key,
+                              const ValueType& expected_value) {
+  auto conn = db->CreateConn();
+  auto actual_value = conn.Get(key);
+  EXPECT_TRUE(actual_value.has_value());
+  EXPECT_EQ(*actual_value, expected_value);
+}
+
+// Get a path under the test temporary directory.
+inline std::string GetTestTmpPath(const std::string& name) {
+  const char* tmp_dir = std::getenv("TEST_TMPDIR");
+  return std::string(tmp_dir == nullptr ? "/tmp" : tmp_dir) + "/" + name;
+}
+
+}  // namespace mvcc
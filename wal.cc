@@ -0,0 +1,340 @@
+#include "wal.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <utility>
+
+namespace mvcc {
+
+namespace {
+
+// Size of record header, which includes payload length and checksum.
+constexpr size_t kRecordHeaderSize = sizeof(uint32_t) * 2;
+
+constexpr std::array<uint32_t, 256> MakeCrc32Table() {
+  std::array<uint32_t, 256> table{};
+  for (uint32_t idx = 0; idx < 256; ++idx) {
+    uint32_t crc = idx;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+    }
+    table[idx] = crc;
+  }
+  return table;
+}
+
+constexpr std::array<uint32_t, 256> kCrc32Table = MakeCrc32Table();
+
+template <typename T>
+void AppendInt(std::string* buffer, T value) {
+  buffer->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+bool ReadInt(const std::string& data, size_t* offset, size_t end, T* value) {
+  if (end - *offset < sizeof(T)) {
+    return false;
+  }
+  std::memcpy(value, data.data() + *offset, sizeof(T));
+  *offset += sizeof(T);
+  return true;
+}
+
+bool ReadString(const std::string& data, size_t* offset, size_t end,
+                std::string* value) {
+  uint32_t len = 0;
+  if (!ReadInt(data, offset, end, &len) || end - *offset < len) {
+    return false;
+  }
+  value->assign(data, *offset, len);
+  *offset += len;
+  return true;
+}
+
+// Parse the record starting at [offset] of [data], return the record end
+// offset, or 0 if it's torn or corrupted.
+size_t ParseRecord(const std::string& data, size_t offset, TxnId* txn_id,
+                   std::vector<WriteRecord>* writes) {
+  uint32_t payload_len = 0;
+  uint32_t checksum = 0;
+  if (!ReadInt(data, &offset, data.size(), &payload_len)
+      || !ReadInt(data, &offset, data.size(), &checksum)
+      || data.size() - offset < payload_len
+      || Crc32(data.data() + offset, payload_len) != checksum) {
+    return 0;
+  }
+
+  const size_t end = offset + payload_len;
+  uint32_t write_num = 0;
+  if (!ReadInt(data, &offset, end, txn_id)
+      || !ReadInt(data, &offset, end, &write_num)) {
+    return 0;
+  }
+  writes->clear();
+  for (uint32_t idx = 0; idx < write_num; ++idx) {
+    WriteRecord write;
+    uint8_t is_deleted = 0;
+    if (!ReadInt(data, &offset, end, &is_deleted)
+        || !ReadString(data, &offset, end, &write.key)
+        || !ReadString(data, &offset, end, &write.value)) {
+      return 0;
+    }
+    write.is_deleted = is_deleted != 0;
+    writes->emplace_back(std::move(write));
+  }
+  return offset == end ? end : 0;
+}
+
+// Read the file at [path] since [offset] into [data].
+bool ReadFile(const std::string& path, uint64_t offset, std::string* data) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  // Records before [offset] are expected to exist.
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0
+      || static_cast<uint64_t>(file_stat.st_size) < offset
+      || lseek(fd, offset, SEEK_SET) < 0) {
+    close(fd);
+    return false;
+  }
+  data->clear();
+  char buf[64 * 1024];
+  while (true) {
+    const ssize_t len = read(fd, buf, sizeof(buf));
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len <= 0) {
+      close(fd);
+      return len == 0;
+    }
+    data->append(buf, len);
+  }
+}
+
+// Durability cannot be guaranteed any more after a failed write or sync, so
+// crash instead of acknowledging commits.
+[[noreturn]] void PanicOnIoError(const char* op) {
+  std::cerr << "Write-ahead log " << op << " fails: " << std::strerror(errno)
+            << std::endl;
+  std::abort();
+}
+
+}  // namespace
+
+uint32_t Crc32(const char* data, size_t len, uint32_t crc) {
+  crc = ~crc;
+  for (size_t idx = 0; idx < len; ++idx) {
+    crc = kCrc32Table[(crc ^ static_cast<uint8_t>(data[idx])) & 0xFF]
+        ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+std::unique_ptr<WriteAheadLog> WriteAheadLog::Open(const std::string& path,
+                                                   uint64_t valid_lsn) {
+  const int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  // Find the end of last complete record, and truncate the torn tail.
+  std::string data;
+  if (!ReadFile(path, valid_lsn, &data)) {
+    close(fd);
+    return nullptr;
+  }
+  size_t valid_len = 0;
+  TxnId txn_id = kInvalidTxnId;
+  std::vector<WriteRecord> writes;
+  while (valid_len < data.size()) {
+    const size_t record_end = ParseRecord(data, valid_len, &txn_id, &writes);
+    if (record_end == 0) {
+      break;
+    }
+    valid_len = record_end;
+  }
+  const uint64_t file_size = valid_lsn + valid_len;
+  if ((valid_len != data.size() && ftruncate(fd, file_size) != 0)
+      || lseek(fd, file_size, SEEK_SET) < 0) {
+    close(fd);
+    return nullptr;
+  }
+
+  return std::unique_ptr<WriteAheadLog>(new WriteAheadLog(fd, file_size));
+}
+
+WriteAheadLog::WriteAheadLog(int fd, uint64_t file_size)
+    : fd_(fd), appended_lsn_(file_size), durable_lsn_(file_size) {}
+
+WriteAheadLog::~WriteAheadLog() {
+  uint64_t appended_lsn = 0;
+  {
+    std::lock_guard lck(mutex_);
+    appended_lsn = appended_lsn_;
+  }
+  WaitDurable(appended_lsn);
+  {
+    std::lock_guard lck(mutex_);
+    stopping_ = true;
+    durable_cv_.notify_all();
+  }
+  if (sync_thread_.joinable()) {
+    sync_thread_.join();
+  }
+  close(fd_);
+}
+
+uint64_t WriteAheadLog::Append(TxnId txn_id,
+                               const std::vector<WriteRecord>& writes) {
+  // Serialize outside of the critical section.
+  std::string record(kRecordHeaderSize, '\0');
+  AppendInt<uint64_t>(&record, txn_id);
+  AppendInt<uint32_t>(&record, writes.size());
+  for (const auto& write : writes) {
+    AppendInt<uint8_t>(&record, write.is_deleted ? 1 : 0);
+    AppendInt<uint32_t>(&record, write.key.size());
+    record.append(write.key);
+    AppendInt<uint32_t>(&record, write.value.size());
+    record.append(write.value);
+  }
+  const uint32_t payload_len = record.size() - kRecordHeaderSize;
+  const uint32_t checksum =
+      Crc32(record.data() + kRecordHeaderSize, payload_len);
+  std::memcpy(record.data(), &payload_len, sizeof(payload_len));
+  std::memcpy(record.data() + sizeof(payload_len), &checksum,
+              sizeof(checksum));
+
+  std::lock_guard lck(mutex_);
+  buffer_.append(record);
+  appended_lsn_ += record.size();
+  return appended_lsn_;
+}
+
+void WriteAheadLog::WaitDurable(uint64_t lsn) {
+  std::unique_lock lck(mutex_);
+  while (durable_lsn_ < lsn) {
+    // Wait for the ongoing group, which might not include [lsn].
+    if (flushing_) {
+      durable_cv_.wait(lck);
+      continue;
+    }
+    // Become the leader, and flush everything buffered so far.
+    FlushGroup(&lck);
+  }
+}
+
+void WriteAheadLog::OnDurable(uint64_t lsn, std::function<void()> callback) {
+  {
+    std::lock_guard lck(mutex_);
+    if (durable_lsn_ < lsn) {
+      if (!sync_thread_.joinable()) {
+        sync_thread_ = std::thread([this]() { RunSyncThread(); });
+      }
+      callbacks_.emplace(lsn, std::move(callback));
+      durable_cv_.notify_all();
+      return;
+    }
+  }
+  callback();
+}
+
+void WriteAheadLog::FlushGroup(std::unique_lock<std::mutex>* lck) {
+  flushing_ = true;
+  std::string group;
+  group.swap(buffer_);
+  const uint64_t group_lsn = appended_lsn_;
+  lck->unlock();
+
+  size_t offset = 0;
+  while (offset < group.size()) {
+    const ssize_t len =
+        write(fd_, group.data() + offset, group.size() - offset);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len < 0) {
+      PanicOnIoError("write");
+    }
+    offset += len;
+  }
+  if (fdatasync(fd_) != 0) {
+    PanicOnIoError("sync");
+  }
+
+  lck->lock();
+  flushing_ = false;
+  durable_lsn_ = group_lsn;
+  durable_cv_.notify_all();
+}
+
+void WriteAheadLog::RunSyncThread() {
+  std::unique_lock lck(mutex_);
+  while (true) {
+    // Invoke durable callbacks outside of the critical section.
+    while (!callbacks_.empty() && callbacks_.begin()->first <= durable_lsn_) {
+      auto callback = std::move(callbacks_.begin()->second);
+      callbacks_.erase(callbacks_.begin());
+      lck.unlock();
+      callback();
+      lck.lock();
+    }
+    if (callbacks_.empty() && stopping_) {
+      return;
+    }
+    // Committers arriving during a group join the next one.
+    if (callbacks_.empty() || flushing_) {
+      durable_cv_.wait(lck);
+    } else {
+      FlushGroup(&lck);
+    }
+  }
+}
+
+uint64_t WriteAheadLog::GetAppendedLsn() {
+  std::lock_guard lck(mutex_);
+  return appended_lsn_;
+}
+
+bool ReplayWal(const std::string& path, Database* db, uint64_t start_lsn) {
+  std::string data;
+  if (!ReadFile(path, start_lsn, &data)) {
+    return false;
+  }
+
+  size_t offset = 0;
+  TxnId txn_id = kInvalidTxnId;
+  std::vector<WriteRecord> writes;
+  while (offset < data.size()) {
+    const size_t record_end = ParseRecord(data, offset, &txn_id, &writes);
+    // Records after a torn one are never acknowledged.
+    if (record_end == 0) {
+      break;
+    }
+    offset = record_end;
+
+    auto conn = db->CreateConn();
+    for (auto& write : writes) {
+      if (write.is_deleted) {
+        conn.Delete(write.key);
+      } else {
+        conn.Set(std::move(write.key), std::move(write.value));
+      }
+    }
+    if (!conn.Commit()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace mvcc
@@ -0,0 +1,99 @@
+// Write-ahead log for [Database], with group commit.
+//
+// Log file is a sequence of records, one for each committed transaction:
+//   record  := payload_len (u32) | crc32(payload) (u32) | payload
+//   payload := txn_id (u64) | write_num (u32) | write*
+//   write   := is_deleted (u8) | key_len (u32) | key | value_len (u32) | value
+// Integers are stored in host byte order.
+//
+// Committers append records into an in-memory buffer. The first committer
+// waiting for durability becomes the leader, which writes and syncs everything
+// buffered so far on behalf of all waiters; committers arriving meanwhile keep
+// buffering for the next group. Asynchronous committers leave flushing to a
+// background sync thread instead, which invokes their callbacks once durable.
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mvcc.h"
+
+namespace mvcc {
+
+class WriteAheadLog : public DurabilityPolicy {
+ public:
+  // Open log file at [path] for appending, create if not exists. Records
+  // before [valid_lsn] are known to be complete and not validated again; a
+  // torn record at the tail, left by crash, gets truncated. Return nullptr on
+  // failure.
+  static std::unique_ptr<WriteAheadLog> Open(const std::string& path,
+                                             uint64_t valid_lsn = 0);
+
+  WriteAheadLog(const WriteAheadLog&) = delete;
+  WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+  // Flush all appended records and close log file.
+  ~WriteAheadLog() override;
+
+  // Log sequence number is the end offset of the record in log file.
+  uint64_t Append(TxnId txn_id,
+                  const std::vector<WriteRecord>& writes) override;
+
+  void WaitDurable(uint64_t lsn) override;
+
+  // Callbacks run on the background sync thread in log order, which is
+  // started on first use.
+  void OnDurable(uint64_t lsn, std::function<void()> callback) override;
+
+  uint64_t GetAppendedLsn() override;
+
+ private:
+  WriteAheadLog(int fd, uint64_t file_size);
+
+  // Write and sync everything buffered so far as one group. [lck] holds
+  // [mutex_], and is released meanwhile.
+  void FlushGroup(std::unique_lock<std::mutex>* lck);
+
+  // Loop of background sync thread, which flushes groups while there're
+  // pending callbacks, and invokes them once durable.
+  void RunSyncThread();
+
+  const int fd_;
+
+  std::mutex mutex_;
+  // Notified when a group becomes durable.
+  std::condition_variable durable_cv_;
+  // Records appended but not written yet.
+  std::string buffer_;
+  // End offset for all appended records.
+  uint64_t appended_lsn_;
+  // End offset for all durable records.
+  uint64_t durable_lsn_;
+  // Whether a leader is writing and syncing a group.
+  bool flushing_ = false;
+  // Callbacks waiting for durability, keyed by log sequence number.
+  std::multimap<uint64_t, std::function<void()>> callbacks_;
+  // Whether background sync thread should exit once no callback is pending.
+  bool stopping_ = false;
+  std::thread sync_thread_;
+};
+
+// Replay records since [start_lsn] in log file at [path] into [db], each as a
+// committed transaction. It should be invoked before any connection is
+// created and before durability policy is set; return false if the log cannot
+// be read.
+bool ReplayWal(const std::string& path, Database* db, uint64_t start_lsn = 0);
+
+// CRC-32 (IEEE) checksum for [len] bytes at [data], continuing from [crc] for
+// previous bytes.
+uint32_t Crc32(const char* data, size_t len, uint32_t crc = 0);
+
+}  // namespace mvcc
@@ -0,0 +1,196 @@
+#include "wal.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "test_utils.h"
+
+namespace mvcc {
+
+// Testing senario: committed transactions from concurrent committers are
+// recovered after restart, while aborted ones are not.
+void TestGroupCommitAndReplay() {
+  const auto path = GetTestTmpPath("wal_test_group_commit.log");
+  unlink(path.c_str());
+
+  constexpr int kThreadNum = 8;
+  constexpr int kIterationNum = 50;
+  {
+    Database db{};
+    auto wal = WriteAheadLog::Open(path);
+    EXPECT_TRUE(wal != nullptr);
+    db.SetDurabilityPolicy(std::move(wal));
+
+    std::vector<std::thread> threads;
+    threads.reserve(kThreadNum);
+    for (int thd_idx = 0; thd_idx < kThreadNum; ++thd_idx) {
+      threads.emplace_back([&db, thd_idx]() {
+        const auto key = "key-" + std::to_string(thd_idx);
+        for (int iter = 0; iter < kIterationNum; ++iter) {
+          auto conn = db.CreateConn();
+          conn.Set(key, std::to_string(iter));
+          EXPECT_TRUE(conn.Commit());
+        }
+      });
+    }
+    for (auto& cur_thread : threads) {
+      cur_thread.join();
+    }
+
+    auto conn = db.CreateConn();
+    conn.Set("deleted-key", "val");
+    conn.Set("aborted-key", "val");
+    EXPECT_TRUE(conn.Commit());
+    auto deleter = db.CreateConn();
+    EXPECT_TRUE(deleter.Delete("deleted-key"));
+    EXPECT_TRUE(deleter.Commit());
+    auto aborted = db.CreateConn();
+    aborted.Set("aborted-key", "aborted-val");
+    aborted.Abort();
+  }
+
+  Database db{};
+  EXPECT_TRUE(ReplayWal(path, &db));
+  for (int thd_idx = 0; thd_idx < kThreadNum; ++thd_idx) {
+    AssertHasKeyValue(&db, "key-" + std::to_string(thd_idx),
+                      std::to_string(kIterationNum - 1));
+  }
+  AssertHasKeyValue(&db, "aborted-key", "val");
+  auto conn = db.CreateConn();
+  EXPECT_FALSE(conn.Get("deleted-key").has_value());
+}
+
+// Testing senario: without first-committer-wins, concurrent writers of the
+// same key could commit in the reverse order of writing; replay still ends up
+// with the latest committed value readers see.
+void TestReverseCommitOrderReplay() {
+  for (const auto isolation_level :
+       {IsolationLevel::kReadCommittedIsolation,
+        IsolationLevel::kRepeatableReadIsolation}) {
+    const auto path = GetTestTmpPath("wal_test_reverse_commit_order.log");
+    unlink(path.c_str());
+    {
+      Database db{};
+      db.SetDurabilityPolicy(WriteAheadLog::Open(path));
+      auto first = db.CreateConn(isolation_level);
+      auto second = db.CreateConn(isolation_level);
+      EXPECT_TRUE(first.Set("key", "a"));
+      EXPECT_TRUE(second.Set("key", "b"));
+      EXPECT_TRUE(second.Commit());
+      AssertHasKeyValue(&db, "key", "b");
+      EXPECT_TRUE(first.Commit());
+      AssertHasKeyValue(&db, "key", "a");
+    }
+
+    Database db{};
+    EXPECT_TRUE(ReplayWal(path, &db));
+    AssertHasKeyValue(&db, "key", "a");
+  }
+}
+
+// Testing senario: a torn record at the tail is truncated when the log gets
+// reopened, and appending continues after the last complete record.
+void TestTornTail() {
+  const auto path = GetTestTmpPath("wal_test_torn_tail.log");
+  unlink(path.c_str());
+
+  {
+    Database db{};
+    db.SetDurabilityPolicy(WriteAheadLog::Open(path));
+    auto conn = db.CreateConn();
+    conn.Set("key", "val");
+    EXPECT_TRUE(conn.Commit());
+  }
+  {
+    const int fd = open(path.c_str(), O_WRONLY | O_APPEND);
+    EXPECT_TRUE(fd >= 0);
+    const std::string garbage = "torn";
+    EXPECT_EQ(write(fd, garbage.data(), garbage.size()),
+              static_cast<ssize_t>(garbage.size()));
+    close(fd);
+  }
+  {
+    Database db{};
+    EXPECT_TRUE(ReplayWal(path, &db));
+    db.SetDurabilityPolicy(WriteAheadLog::Open(path));
+    auto conn = db.CreateConn();
+    conn.Set("another-key", "another-val");
+    EXPECT_TRUE(conn.Commit());
+  }
+
+  Database db{};
+  EXPECT_TRUE(ReplayWal(path, &db));
+  AssertHasKeyValue(&db, "key", "val");
+  AssertHasKeyValue(&db, "another-key", "another-val");
+}
+
+// Testing senario: a single thread keeps many asynchronous commits in flight,
+// which are acknowledged once durable, and recovered after restart.
+void TestAsyncCommit() {
+  const auto path = GetTestTmpPath("wal_test_async_commit.log");
+  unlink(path.c_str());
+
+  constexpr int kTxnNum = 1000;
+  std::atomic<int> committed_num{0};
+  std::atomic<int> aborted_num{0};
+  {
+    Database db{};
+    auto wal = WriteAheadLog::Open(path);
+    EXPECT_TRUE(wal != nullptr);
+    db.SetDurabilityPolicy(std::move(wal));
+
+    const auto done = [&](bool committed) {
+      ++(committed ? committed_num : aborted_num);
+    };
+    for (int idx = 0; idx < kTxnNum; ++idx) {
+      auto conn = db.CreateConn();
+      conn.Set("key-" + std::to_string(idx), std::to_string(idx));
+      conn.CommitAsync(done);
+    }
+
+    // Conflicting ones are decided at once.
+    auto conn1 = db.CreateConn();
+    auto conn2 = db.CreateConn();
+    conn1.Set("key-0", "conflict-1");
+    conn2.Set("key-0", "conflict-2");
+    conn1.CommitAsync(done);
+    conn2.CommitAsync([&](bool committed) {
+      EXPECT_FALSE(committed);
+      done(committed);
+    });
+    EXPECT_EQ(aborted_num.load(), 1);
+
+    // Transactions without writes have nothing to wait for.
+    auto reader = db.CreateConn();
+    EXPECT_TRUE(reader.Get("key-1").has_value());
+    bool reader_committed = false;
+    reader.CommitAsync([&](bool committed) { reader_committed = committed; });
+    EXPECT_TRUE(reader_committed);
+
+    while (committed_num < kTxnNum + 1) {
+      std::this_thread::yield();
+    }
+  }
+
+  Database db{};
+  EXPECT_TRUE(ReplayWal(path, &db));
+  AssertHasKeyValue(&db, "key-0", "conflict-1");
+  AssertHasKeyValue(&db, "key-1", "1");
+  AssertHasKeyValue(&db, "key-" + std::to_string(kTxnNum - 1),
+                    std::to_string(kTxnNum - 1));
+}
+
+}  // namespace mvcc
+
+int main(int argc, char** argv) {
+  mvcc::TestGroupCommitAndReplay();
+  mvcc::TestReverseCommitOrderReplay();
+  mvcc::TestTornTail();
+  mvcc::TestAsyncCommit();
+  return 0;
+}